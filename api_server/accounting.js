@@ -0,0 +1,239 @@
+// Running energy and relay-cycle counters, updated on every switch or phase transition seen by
+// the API (writes through the API and out-of-band changes picked up by the poller).
+// Switch and phase states are kept as bitmasks (bit i = switch i+1) so that each transition only
+// touches the switches that changed and the per-phase power is a popcount when ratings are equal.
+// Counters are persisted to ACCOUNTING_FILE every ACCOUNTING_PERSIST_MS.
+
+const fs = require('fs')
+const path = require('path')
+const deviceState = require('./device_state')
+const logger = require('./logger')
+
+// define the bank geometry (the NUM_SWITCHES and NUM_PHASES the serial interface was built with) and where the counters are kept
+const numSwitches = parseInt(process.env.LOAD_BANK_NUM_SWITCHES || 18)
+const numPhases = parseInt(process.env.LOAD_BANK_NUM_PHASES || 3)
+const accountingFile = process.env.ACCOUNTING_FILE || path.join(__dirname, "accounting.json")
+const persistIntervalMs = parseInt(process.env.ACCOUNTING_PERSIST_MS || 60000)
+
+// per-switch ratings in kW, from the same LOAD_BANK_RATINGS_KW list the serial interface uses
+const defaultRatingKw = 1.0
+var ratings = new Array(numSwitches).fill(defaultRatingKw)
+if (process.env.LOAD_BANK_RATINGS_KW) {
+	process.env.LOAD_BANK_RATINGS_KW.split(",").slice(0, numSwitches).forEach((rating, i) => {
+		if (!isNaN(parseFloat(rating))) {
+			ratings[i] = parseFloat(rating)
+		}
+	})
+}
+const uniformRating = ratings.every(rating => rating === ratings[0])
+
+// current state as bitmasks; null until the first state has been observed
+var switchMask = null
+var phaseMasks = null
+var phaseKw = new Array(numPhases).fill(0)
+var lastUpdate = Date.now()
+
+// counters (persisted)
+var counters = {
+	since: Date.now(),
+	on_time_ms: new Array(numSwitches).fill(0),
+	cycles: new Array(numSwitches).fill(0),
+	energy_kwh: new Array(numPhases).fill(0),
+}
+
+// time each switch was last turned on (only meaningful while it is on)
+var onSince = new Array(numSwitches).fill(0)
+
+// banks of up to 32 switches keep their masks in plain 32-bit numbers; wider banks use BigInt masks
+const wide = numSwitches > 32
+const ZERO = wide ? 0n : 0
+const ONE = wide ? 1n : 1
+
+// mask with only switch i+1 set
+function bit(i) {
+	return wide ? (1n << BigInt(i)) : (1 << i)
+}
+
+// number of set bits in a mask
+function popcount(mask) {
+	if (wide) {
+		var count = 0
+		for (; mask !== ZERO; mask &= mask - ONE) {
+			count++
+		}
+		return count
+	}
+	mask = mask - ((mask >>> 1) & 0x55555555)
+	mask = (mask & 0x33333333) + ((mask >>> 2) & 0x33333333)
+	return (((mask + (mask >>> 4)) & 0x0F0F0F0F) * 0x01010101) >>> 24
+}
+
+// index of the lowest set bit of a nonzero mask
+function lowestBit(mask) {
+	if (wide) {
+		return (mask & -mask).toString(2).length - 1
+	}
+	return 31 - Math.clz32(mask & -mask)
+}
+
+// convert a switch string ("111111000000111111") to a bitmask
+function switchesToMask(switches) {
+	var mask = ZERO
+	for (let i = 0; i < switches.length; i++) {
+		if (switches[i] === "1") {
+			mask |= bit(i)
+		}
+	}
+	return mask
+}
+
+// convert a phase string ("111111222222333333") to one bitmask per phase
+function phasesToMasks(phases) {
+	var masks = new Array(numPhases).fill(ZERO)
+	for (let i = 0; i < phases.length; i++) {
+		const phase = parseInt(phases[i]) - 1
+		if (phase >= 0 && phase < numPhases) {
+			masks[phase] |= bit(i)
+		}
+	}
+	return masks
+}
+
+// load currently drawn by each phase, from the switches that are on
+function updatePhaseKw() {
+	for (let p = 0; p < numPhases; p++) {
+		var on = switchMask & phaseMasks[p]
+		if (uniformRating) {
+			phaseKw[p] = popcount(on) * ratings[0]
+		} else {
+			var kw = 0
+			for (; on !== ZERO; on &= on - ONE) {
+				kw += ratings[lowestBit(on)]
+			}
+			phaseKw[p] = kw
+		}
+	}
+}
+
+// add the energy drawn since the last update at the current per-phase load
+function integrate(now) {
+	const hours = (now - lastUpdate) / 3600000
+	for (let p = 0; p < numPhases; p++) {
+		counters.energy_kwh[p] += phaseKw[p] * hours
+	}
+	lastUpdate = now
+}
+
+// apply a new switch mask, touching only the switches that changed
+function applySwitches(mask, now) {
+	var changed = (switchMask ^ mask)
+	for (; changed !== ZERO; changed &= changed - ONE) {
+		const i = lowestBit(changed)
+		if ((mask & bit(i)) !== ZERO) {
+			onSince[i] = now
+			counters.cycles[i]++
+		} else {
+			counters.on_time_ms[i] += now - onSince[i]
+		}
+	}
+	switchMask = mask
+}
+
+// called by the device state tracker on every change to the reported state
+function onStateChange(field, oldValue, newValue) {
+	if (field !== "switches" && field !== "phases") {
+		return
+	}
+	const now = Date.now()
+
+	// before both parts of the state are known there is nothing to account against
+	if (switchMask === null || phaseMasks === null) {
+		if (field === "switches") {
+			switchMask = switchesToMask(newValue)
+			for (let i = 0; i < numSwitches; i++) {
+				onSince[i] = now
+			}
+		} else {
+			phaseMasks = phasesToMasks(newValue)
+		}
+		if (switchMask !== null && phaseMasks !== null) {
+			updatePhaseKw()
+		}
+		lastUpdate = now
+		return
+	}
+
+	integrate(now)
+	if (field === "switches") {
+		applySwitches(switchesToMask(newValue), now)
+	} else {
+		phaseMasks = phasesToMasks(newValue)
+	}
+	updatePhaseKw()
+}
+
+// bring the counters up to now, including the time switches that are still on have been on
+function current() {
+	const now = Date.now()
+	if (switchMask !== null && phaseMasks !== null) {
+		integrate(now)
+	}
+	var onTime = counters.on_time_ms.slice()
+	if (switchMask !== null) {
+		for (let on = switchMask; on !== ZERO; on &= on - ONE) {
+			const i = lowestBit(on)
+			onTime[i] += now - onSince[i]
+			counters.on_time_ms[i] += now - onSince[i]
+			onSince[i] = now
+		}
+	}
+	return onTime
+}
+
+// the counters as returned by the API
+function status() {
+	const onTime = current()
+	return {
+		status: "OK",
+		since: counters.since,
+		switches: onTime.map((ms, i) => ({ switch: i + 1, on_time_s: ms / 1000, cycles: counters.cycles[i], rating_kw: ratings[i] })),
+		phases: counters.energy_kwh.map((kwh, p) => ({ phase: p + 1, energy_kwh: kwh, power_kw: phaseKw[p] })),
+	}
+}
+
+// write the counters to the accounting file (via a temporary file so a crash never leaves it half written)
+// resolves once the file is in place
+function persist() {
+	current()
+	const tmp = accountingFile + ".tmp"
+	return new Promise(resolve => {
+		fs.writeFile(tmp, JSON.stringify(counters), (error) => {
+			if (error) {
+				logger.error("could not save accounting counters", { error: error.message })
+				resolve()
+				return
+			}
+			fs.rename(tmp, accountingFile, () => resolve())
+		})
+	})
+}
+
+// load saved counters and start tracking state changes
+function start() {
+	try {
+		const saved = JSON.parse(fs.readFileSync(accountingFile))
+		if (saved.on_time_ms.length === numSwitches && saved.energy_kwh.length === numPhases) {
+			counters = saved
+		}
+	} catch (error) {
+		logger.info("starting new accounting counters", { reason: error.message })
+	}
+	deviceState.onChange(onStateChange)
+	setInterval(persist, persistIntervalMs).unref()
+}
+
+module.exports = {
+	start,
+	status,
+	persist,
+}
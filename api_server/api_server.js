@@ -1,95 +1,433 @@
 // define http object
 const http = require('http')
 
+// define the modules that serialise device access and keep track of device state
+const deviceQueue = require('./device_queue')
+const deviceState = require('./device_state')
+const poller = require('./poller')
+const tracing = require('./tracing')
+const jobs = require('./jobs')
+const accounting = require('./accounting')
+const deviceLock = require('./device_lock')
+const lease = require('./lease')
+const transport = require('./transport')
+const snapshotStore = require('./snapshot_store')
+const binaryApi = require('./binary_api')
+const zcsStats = require('./zcs_stats')
+const idempotency = require('./idempotency')
+const logger = require('./logger')
+
 // define port the api server will run on
 const port = process.env.PORT || 6001
 
 // define the absolute path of the serial interface program on the raspberry pi
-const serialInterfacePath = "/home/ubuntu/load_bank/serial_interface/serial_interface"
+const serialInterfacePath = process.env.SERIAL_INTERFACE_PATH || "/home/ubuntu/load_bank/serial_interface/serial_interface"
+
+// define the group command program and the devices a group command goes to by default
+// (comma-separated serial:<device> or tcp:<host>:<port> entries); clients can pick a subset of them with
+// ?devices=, but never name any other device
+const groupPath = process.env.LOAD_BANK_GROUP_PATH || "/home/ubuntu/load_bank/serial_interface/load_bank_group"
+const groupDevices = (process.env.LOAD_BANK_GROUP_DEVICES || "").split(",").filter(device => device !== "")
+
+// the group devices that are the bank this server controls (over its serial device or a tcp path to it), whose
+// state a group write changes just as a write through this API does
+const localGroupDevices = [`serial:${process.env.LOAD_BANK_DEVICE || "/dev/ttyUSB0"}`].concat(
+	transport.status().paths.map(path => path.name).filter(name => name.startsWith("tcp:")))
+
+// define the number of phases the serial interface was built with (its NUM_PHASES), one PHASEPATCH operation each
+const numPhases = parseInt(process.env.LOAD_BANK_NUM_PHASES || 3)
+const phaseOpNames = Array.from({ length: numPhases }, (_, p) => `phase${p + 1}`)
+
+// define the default limits on how much a single switch step may change (0 means no limit)
+// switch requests that exceed them are split into several steps, each applied on its own zero crossing
+const maxStepRelays = process.env.MAX_STEP_RELAYS || 0
+const maxStepKw = process.env.MAX_STEP_KW || 0
 
 // Define the API server object
 const server = http.createServer( (req,res) => {
 
-	console.log(`req.headers.host = ${req.headers.host}`)
-	console.log(`request.url = ${req.url}`)
 	const url = new URL(req.url, `http://${req.headers.host}`)
-	console.log(`url = ${url}`)
 	var path =  url.pathname
 	if (url.pathname.endsWith('/')) {
-		console.log(`trailing slash = ${url.pathname}`)
-		console.log(`removing trailing slash = ${url.pathname.substr(0, url.pathname.length -1)}`)
 		path =  url.pathname.substr(0, url.pathname.length -1)
 	}
 
-	console.log(`path = ${path}`)
-	console.log(url.searchParams);
+	// one log record per request, written once the response has gone out (handlers add to res.logFields)
+	const startedAt = process.hrtime.bigint()
+	res.logFields = {}
+	res.on("finish", () => logger.request(Object.assign({
+		method: req.method,
+		route: path,
+		status: res.statusCode,
+		ms: Number(process.hrtime.bigint() - startedAt) / 1e6,
+	}, res.logFields)))
 
 	// depending on the URL supplied, call the serial interface with the correct arguments
 	switch(path) {
 		case '/api/v1/phases/status':
-			spawnCmd(res, serialInterfacePath, ["PHASE?"]);
+			statusCmd(req, res, ["PHASE?"], "phases");
 			break
 		case '/api/v1/phases':
+			if (req.method === 'PATCH') {
+				patchCmd(req, res, url, "PHASEPATCH", phaseOpNames)
+				break
+			}
 			var values = url.searchParams.get("values")
-			spawnCmd(res, serialInterfacePath, ["PHASE", values]);
+			writeCmd(req, res, url, ["PHASE", values]);
+			break
+		case '/api/v1/phases/patch':
+			patchCmd(req, res, url, "PHASEPATCH", phaseOpNames)
 			break
 		case '/api/v1/switches/status':
-			spawnCmd(res, serialInterfacePath, ["SW?"]);
+			statusCmd(req, res, ["SW?"], "switches");
 			break;
 		case '/api/v1/switches':
+			if (req.method === 'PATCH') {
+				patchCmd(req, res, url, "SWPATCH", ["on", "off", "toggle"])
+				break
+			}
 			var values = url.searchParams.get("values")
-			spawnCmd(res, serialInterfacePath, ["SW", values]);
+			var maxRelays = url.searchParams.get("max_relays") || maxStepRelays
+			var maxKw = url.searchParams.get("max_kw") || maxStepKw
+			if (maxRelays != 0 || maxKw != 0) {
+				writeCmd(req, res, url, ["SW", values, `${maxRelays}`, `${maxKw}`]);
+			} else {
+				writeCmd(req, res, url, ["SW", values]);
+			}
+			break
+		case '/api/v1/switches/patch':
+			patchCmd(req, res, url, "SWPATCH", ["on", "off", "toggle"])
 			break
 		case '/api/v1/zcs/status':
-			spawnCmd(res, serialInterfacePath, ["ZCS?"]);
+			statusCmd(req, res, ["ZCS?"], "zcs");
 			break
 		case '/api/v1/zcs/on':
-			spawnCmd(res, serialInterfacePath, ["ZCS", "ON"]);
+			idempotentCmd(req, res, url, ["ZCS", "ON"], () => tracedCmd(["ZCS", "ON"]));
 			break
 		case '/api/v1/zcs/off':
-			spawnCmd(res, serialInterfacePath, ["ZCS", "OFF"]);
+			idempotentCmd(req, res, url, ["ZCS", "OFF"], () => tracedCmd(["ZCS", "OFF"]));
+			break
+		case '/api/v1/zcs/stats':
+			res.writeHead(200, { 'Content-Type': 'text/plain' })
+			res.end(JSON.stringify(zcsStats.status()) + "\n")
+			break
+		case '/api/v1/state':
+			statusCmd(req, res, ["STATE?"], ["switches", "phases", "zcs"])
+			break
+		case '/api/v1/state/watch':
+			watchState(res, url)
+			break
+		case '/api/v1/group/switches':
+			groupCmd(req, res, url, "SW")
+			break
+		case '/api/v1/group/phases':
+			groupCmd(req, res, url, "PHASE")
+			break
+		case '/api/v1/device/latency':
+			var samples = url.searchParams.get("samples") || "20"
+			spawnCmd(res, serialInterfacePath, ["LATENCY", samples]);
+			break
+		case '/api/v1/device/holder':
+			res.writeHead(200, { 'Content-Type': 'text/plain' })
+			res.end(JSON.stringify(deviceLock.holder()))
+			break
+		case '/api/v1/transport':
+			res.writeHead(200, { 'Content-Type': 'text/plain' })
+			res.end(JSON.stringify(transport.status()))
+			break
+		case '/api/v1/lease':
+			res.writeHead(200, { 'Content-Type': 'text/plain' })
+			res.end(JSON.stringify(lease.status()))
+			break
+		case '/api/v1/lease/renew':
+			var holder = url.searchParams.get("holder") || req.socket.remoteAddress
+			var leaseResult = lease.renew(holder, parseInt(url.searchParams.get("ttl") || 0))
+			res.writeHead(leaseResult.status === "OK" ? 200 : 409, { 'Content-Type': 'text/plain' })
+			res.end(JSON.stringify(leaseResult))
+			break
+		case '/api/v1/lease/release':
+			var holder = url.searchParams.get("holder") || req.socket.remoteAddress
+			var leaseResult = lease.release(holder)
+			res.writeHead(leaseResult.status === "OK" ? 200 : 409, { 'Content-Type': 'text/plain' })
+			res.end(JSON.stringify(leaseResult))
+			break
+		case '/api/v1/idempotency':
+			res.writeHead(200, { 'Content-Type': 'text/plain' })
+			res.end(JSON.stringify(idempotency.status()))
+			break
+		case '/api/v1/accounting':
+			res.writeHead(200, { 'Content-Type': 'text/plain' })
+			res.end(JSON.stringify(accounting.status()))
+			break
+		case '/api/v1/poller/status':
+			res.writeHead(200, { 'Content-Type': 'text/plain' })
+			res.end(JSON.stringify(poller.status()))
 			break
 		default:
+			if (path.startsWith('/api/v1/jobs/')) {
+				jobStatus(res, url, path.substr('/api/v1/jobs/'.length))
+				break
+			}
 			res.writeHead(404, { 'Content-Type': 'text/plain' })
 			res.end('Not Found')
 			break
 		}
 	})
 
-// start the API server
-server.listen(port, () => console.log(`server started on port ${port}; ` +
+// start the API servers and the background poller
+deviceQueue.init(serialInterfacePath)
+accounting.start()
+snapshotStore.start()
+
+// on SIGINT or SIGTERM (eg. systemctl stop), save the accounting counters and write out the log before exiting
+// (a second signal, or shutdown taking more than shutdownTimeoutMs, exits straight away)
+const shutdownTimeoutMs = 3000
+for (const signal of ["SIGINT", "SIGTERM"]) {
+	process.once(signal, async () => {
+		const exitCode = 128 + (signal === "SIGINT" ? 2 : 15)
+		setTimeout(() => process.exit(exitCode), shutdownTimeoutMs)
+		for (const other of ["SIGINT", "SIGTERM"]) {
+			process.once(other, () => process.exit(exitCode))
+		}
+		logger.info("shutting down", { signal: signal })
+		await accounting.persist()
+		await logger.close()
+		process.exit(exitCode)
+	})
+}
+transport.start(deviceQueue)
+server.listen(port, () => logger.info(`server started on port ${port}; ` +
   'press Ctrl-C to terminate....'))
+// (binary replies have no way to mark a state unverified, so the binary API only answers from the cache while a write is in flight)
+binaryApi.start(runCmd, field => deviceState.isVerified(field) ? cachedState(field) : null)
+poller.start()
 
-// run a command in the command line from Javascript and put the resuld in res
-function spawnCmd(res, cmd, args) {
-	const { spawn } = require("child_process")
-	if (args === "") {
-		var ls = spawn(cmd)
-	} else {
-		var ls = spawn(cmd, args)
+// answer a status query; each answer carries an ETag for the current state generation
+// if the client already has the current generation (If-None-Match), answer 304 Not Modified without asking the board
+// while a write is waiting on the device (e.g. for a zero crossing), answer from the cached state instead of queueing behind it
+// after a restart, answer from the restored snapshot (marked unverified) until the poller has confirmed it with the board;
+// never with 304 though, since the generation is carried over from before the restart and the board may have changed since
+// field may be a list of fields (the full state query), in which case each of them must be known to answer without the board
+function statusCmd(req, res, args, field) {
+	const fields = [].concat(field)
+	if (fields.every(field => deviceState.snapshot[field] !== null)) {
+		if (req.headers['if-none-match'] === deviceState.etag() && fields.every(deviceState.isVerified)) {
+			res.writeHead(304, { 'ETag': deviceState.etag() })
+			res.end()
+			return
+		}
+		if (fields.every(field => cachedState(field) !== null)) {
+			res.logFields.cached = true
+			var result = { status: "OK", cached: true }
+			if (!fields.every(deviceState.isVerified)) {
+				result.unverified = true
+			}
+			fields.forEach(field => result[field] = deviceState.snapshot[field])
+			res.writeHead(200, { 'Content-Type': 'text/plain', 'ETag': deviceState.etag() })
+			res.end(JSON.stringify(result) + "\n")
+			return
+		}
+	}
+	spawnCmd(res, serialInterfacePath, args, true)
+}
+
+// the state to answer a query for field with instead of asking the board, or null to ask the board:
+// the cached state while a write is in flight, or the restored snapshot until the board has confirmed it
+function cachedState(field) {
+	if (deviceState.snapshot[field] !== null && (deviceQueue.writeInFlight() || !deviceState.isVerified(field))) {
+		return deviceState.snapshot[field]
+	}
+	return null
+}
+
+// long-poll for a state change: answer as soon as the state generation differs from ?generation=
+// (or straight away if it already does), and after ?timeout= ms (default 30 s) at the latest
+async function watchState(res, url) {
+	const since = parseInt(url.searchParams.get("generation") || deviceState.getGeneration())
+	const timeoutMs = Math.min(parseInt(url.searchParams.get("timeout") || 30000), 120000)
+	await deviceState.waitForChange(since, timeoutMs)
+
+	const snapshot = deviceState.snapshot
+	res.writeHead(200, { 'Content-Type': 'text/plain', 'ETag': deviceState.etag() })
+	res.end(JSON.stringify({
+		status: "OK",
+		generation: deviceState.getGeneration(),
+		changed: deviceState.getGeneration() !== since,
+		switches: snapshot.switches,
+		phases: snapshot.phases,
+		zcs: snapshot.zcs,
+		verified: ["switches", "phases", "zcs"].every(deviceState.isVerified),
+	}) + "\n")
+}
+
+// run a SW or PHASE write; with ?async=1 reply 202 Accepted with a job id straight away
+function writeCmd(req, res, url, args) {
+	var asyncParam = url.searchParams.get("async")
+	if (asyncParam !== "1" && asyncParam !== "true") {
+		idempotentCmd(req, res, url, args, () => tracedCmd(args))
+		return
 	}
 
-	console.log(`command is ${cmd} ${args}`)
+	// a retry of an asynchronous write gets the id of the job the first attempt started
+	idempotentCmd(req, res, url, args.concat("async"), async () => {
+		const job = jobs.create(args, runCmd(args, null).then(result => result.error !== null ? result.error.message : result.stdout + result.stderr))
+		return {
+			statusCode: 202,
+			headers: { 'Location': `/api/v1/jobs/${job.id}` },
+			body: JSON.stringify({ status: "Accepted", job: job.id, location: `/api/v1/jobs/${job.id}` }) + "\n",
+			retryable: false,
+		}
+	})
+}
 
-	ls.stdout.on("data", data => {
-		console.log(`stdout: ${data}`)
-		res.writeHead(200, { 'Content-Type': 'text/plain' })
-		res.end(`${data}`)
-	});
+// answer a write with the response start() resolves to; with an idempotency key (see idempotency.js),
+// a retry of a write that already ran or is still running gets the same response without running it again
+async function idempotentCmd(req, res, url, args, start) {
+	const outcome = await idempotency.run(idempotency.keyOf(req, url), args.join(" "), start)
+	if (outcome.conflict) {
+		res.writeHead(422, { 'Content-Type': 'text/plain' })
+		res.end(JSON.stringify({ status: "Unprocessable Entity", msg: "Idempotency key was already used for a different request" }) + "\n")
+		return
+	}
+	const headers = Object.assign({ 'Content-Type': 'text/plain' }, outcome.response.headers)
+	Object.assign(res.logFields, outcome.response.logFields)
+	if (outcome.replayed) {
+		headers['Idempotent-Replayed'] = "true"
+		res.logFields.replayed = true
+	}
+	res.writeHead(outcome.response.statusCode, headers)
+	res.end(outcome.response.body)
+}
 
-	ls.stderr.on("data", data => {
-		console.log(`stderr: ${data}`)
-		res.writeHead(500, { 'Content-Type': 'text/plain' })
-		res.end(`${data}`)
-	});
+// run a partial update (eg. ?on=7&off=1-6 or ?phase2=1-6) as a single read-modify-write on the device
+// the operations are passed on in the order they appear in the query string
+// switch updates are staged under the same step limits as a full switch write (?max_relays=, ?max_kw=)
+function patchCmd(req, res, url, command, opNames) {
+	var args = [command]
+	for (const [name, value] of url.searchParams) {
+		if (opNames.includes(name)) {
+			args.push(`${name}=${value}`)
+		}
+	}
+	if (command === "SWPATCH") {
+		var maxRelays = url.searchParams.get("max_relays") || maxStepRelays
+		var maxKw = url.searchParams.get("max_kw") || maxStepKw
+		if (maxRelays != 0 || maxKw != 0) {
+			args.push(`max_relays=${maxRelays}`, `max_kw=${maxKw}`)
+		}
+	}
+	writeCmd(req, res, url, args)
+}
+
+// send the same SW or PHASE command to a group of load banks so that they all switch at the same moment
+// ?devices= picks some of the configured group devices (any other device is refused); ?delay= sets how long after preparation the writes are released (ms)
+function groupCmd(req, res, url, command) {
+	var values = url.searchParams.get("values")
+	var devices = url.searchParams.get("devices") ? url.searchParams.get("devices").split(",").filter(device => device !== "") : groupDevices
+	var unknown = devices.filter(device => !groupDevices.includes(device))
+	if (unknown.length > 0) {
+		res.writeHead(403, { 'Content-Type': 'text/plain' })
+		res.end(JSON.stringify({ status: "Forbidden", msg: `Not a configured group device: ${unknown.join(",")}` }) + "\n")
+		return
+	}
+	var args = ["-d", url.searchParams.get("delay") || "50", command, values].concat(devices)
 
-	ls.on('error', (error) => {
-		console.log(`error: ${error.message}`)
-		res.writeHead(500, { 'Content-Type': 'text/plain' })
-		res.end(`${error.message}`)
-	});
+	idempotentCmd(req, res, url, ["group"].concat(args), async () => {
+		const trace = tracing.startTrace()
+		const result = await deviceQueue.submit(args, deviceQueue.PRIORITY_USER, trace, groupPath)
+		recordGroupWrite(command, values, result.stdout)
+		poller.kick()
 
-	ls.on("close", code => {
-		console.log(`child process exited with code ${code}`)
-	});
+		const statusCode = result.error !== null ? 500 : 200
+		if (trace !== null) {
+			tracing.span(trace, "request", trace.start, tracing.nowUs(), { args: args.join(" "), status: statusCode })
+		}
+		return {
+			statusCode: statusCode,
+			body: result.error !== null ? `${result.error.message}` : `${result.stdout}`,
+			retryable: result.started === false,
+			logFields: { args: args.join(" "), code: result.code, queue_ms: result.queue_ms, run_ms: result.run_ms },
+		}
+	})
+}
+
+// if the bank this server controls took part in a group write and acknowledged it, record the value it was set to
+function recordGroupWrite(command, values, stdout) {
+	var reply
+	try {
+		reply = JSON.parse(stdout)
+	} catch (error) {
+		return
+	}
+	const local = (reply.devices || []).find(device => localGroupDevices.includes(device.device))
+	if (local !== undefined && local.reply.startsWith("OK")) {
+		deviceState.recordAcknowledged(command, values)
+	}
+}
+
+// report on an asynchronous job; with ?wait=ms wait up to that long for it to finish
+async function jobStatus(res, url, id) {
+	const job = jobs.get(id)
+	if (job === undefined) {
+		res.writeHead(404, { 'Content-Type': 'text/plain' })
+		res.end(JSON.stringify({ status: "Not Found", msg: `No job ${id}` }) + "\n")
+		return
+	}
+	var waitMs = parseInt(url.searchParams.get("wait") || 0)
+	if (!(waitMs > 0)) {
+		waitMs = 0
+	}
+	await jobs.wait(job, Math.min(waitMs, 60000))
+	res.writeHead(200, { 'Content-Type': 'text/plain' })
+	res.end(JSON.stringify(jobs.describe(job)) + "\n")
+}
+
+// run the serial interface with args through the device queue and update the tracked device state
+async function runCmd(args, trace) {
+	const result = await deviceQueue.submit(args, deviceQueue.PRIORITY_USER, trace)
+
+	// writes (and any out-of-band change they reveal) make the poller speed up again
+	deviceState.record(args, result.stdout)
+	if (deviceState.isWrite(args)) {
+		poller.kick()
+	}
+	return result
+}
+
+// run the serial interface with args (traced if sampled) and resolve to the response { statusCode, body, retryable }
+// the response is retryable if the command never reached the board: it was cancelled before it ran (eg. by a load
+// shed), or it could not be sent on any path (exit status 3)
+async function tracedCmd(args) {
+	const trace = tracing.startTrace()
+	const result = await runCmd(args, trace)
+
+	var response
+	if (result.error !== null) {
+		logger.warn("command failed", { args: args.join(" "), error: result.error.message })
+		response = { statusCode: 500, body: `${result.error.message}` }
+	} else if (result.stderr !== "") {
+		logger.warn("command wrote to stderr", { args: args.join(" "), stderr: result.stderr })
+		response = { statusCode: 500, body: `${result.stderr}` }
+	} else {
+		logger.debug("command output", { args: args.join(" "), stdout: result.stdout })
+		response = { statusCode: 200, body: `${result.stdout}` }
+	}
+	response.retryable = (result.started === false || result.code === 3)
+	response.logFields = { args: args.join(" "), code: result.code, queue_ms: result.queue_ms, run_ms: result.run_ms }
+	if (trace !== null) {
+		tracing.span(trace, "request", trace.start, tracing.nowUs(), { args: args.join(" "), status: response.statusCode })
+	}
+	return response
+}
+
+// run the serial interface with args and put the result in res, tagged with the state generation if withEtag is set
+// (cmd is kept for the existing call sites; the queue always runs the configured serial interface)
+async function spawnCmd(res, cmd, args, withEtag = false) {
+	const response = await tracedCmd(args)
+	Object.assign(res.logFields, response.logFields)
+	if (withEtag && response.statusCode === 200) {
+		res.setHeader('ETag', deviceState.etag())
+	}
+	res.writeHead(response.statusCode, { 'Content-Type': 'text/plain' })
+	res.end(response.body)
 }
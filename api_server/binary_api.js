@@ -0,0 +1,279 @@
+// Compact binary API for machine clients that need more commands per second than the JSON API gives.
+// It listens on a local socket (BINARY_API_LISTEN: a Unix socket path, or [host:]port for TCP) and runs
+// the same device commands as the HTTP routes, through the same device queue, without URLs or JSON.
+// Every frame is a big-endian uint16 length (of the rest of the frame) followed by
+//	request:	uint32 id, uint8 command, payload
+//	reply:		uint32 id, uint8 status, payload
+// A client may pipeline any number of requests; each one is answered with its own id once it completes.
+// Switch masks are MASK_BYTES bytes, big-endian, bit i for switch i + 1 (the layout of mask_to_buf in
+// load_bank_geometry.h); phase definitions are one such mask per phase, phase 1 first.
+//	command		payload			reply payload
+//	SW_GET		-			switch mask
+//	SW_SET		switch mask		switch mask read back
+//	PHASE_GET	-			phase masks
+//	PHASE_SET	phase masks		phase masks read back
+//	ZCS_GET		-			1 byte, 1 if zero-crossing switching is on
+//	ZCS_SET		1 byte (0 or 1)		1 byte read back
+//	GEOMETRY	-			uint8 switches, uint8 phases, uint8 mask bytes
+// Replies other than STATUS_OK carry a UTF-8 message as their payload.
+
+const net = require('net')
+const fs = require('fs')
+const logger = require('./logger')
+
+// define where the binary API listens ("" turns it off)
+const listenAddress = (process.env.BINARY_API_LISTEN !== undefined) ? process.env.BINARY_API_LISTEN : "127.0.0.1:6002"
+
+// bank geometry (must match the serial interface build, see load_bank_geometry.h)
+const numSwitches = parseInt(process.env.LOAD_BANK_NUM_SWITCHES || 18)
+const numPhases = parseInt(process.env.LOAD_BANK_NUM_PHASES || 3)
+const maskBytes = (numSwitches <= 32) ? 4 : (numSwitches <= 64) ? 8 : 16
+
+// define the command ids
+const CMD_SW_GET = 1
+const CMD_SW_SET = 2
+const CMD_PHASE_GET = 3
+const CMD_PHASE_SET = 4
+const CMD_ZCS_GET = 5
+const CMD_ZCS_SET = 6
+const CMD_GEOMETRY = 7
+
+// define the reply statuses
+const STATUS_OK = 0
+const STATUS_BAD_REQUEST = 1		// unknown command, wrong payload length, or rejected by the board
+const STATUS_TIMEOUT = 2		// the board did not see a zero crossing in time
+const STATUS_DEVICE_ERROR = 3		// the board could not be reached or gave no answer
+
+// largest frame accepted (the rest of a longer one could never be told apart from the next frame)
+const MAX_FRAME = 1024
+
+// ******************************************** MASK ENCODING ******************************************** //
+
+// switch string ("1010...", first switch first) to a mask buffer
+function switchesToMask(switches) {
+	const mask = Buffer.alloc(maskBytes)
+	for (let i = 0; i < numSwitches; i++) {
+		if (switches[i] === "1") {
+			mask[maskBytes - 1 - (i >> 3)] |= 1 << (i & 7)
+		}
+	}
+	return mask
+}
+
+// mask buffer to a switch string
+function maskToSwitches(mask) {
+	var switches = ""
+	for (let i = 0; i < numSwitches; i++) {
+		switches += (mask[maskBytes - 1 - (i >> 3)] >> (i & 7)) & 1
+	}
+	return switches
+}
+
+// phase string ("111222...", '?' for a switch on no phase) to numPhases masks in a row
+function phasesToMasks(phases) {
+	const masks = Buffer.alloc(numPhases * maskBytes)
+	for (let i = 0; i < numSwitches; i++) {
+		const p = phases.charCodeAt(i) - 49
+		if (p >= 0 && p < numPhases) {
+			masks[p * maskBytes + maskBytes - 1 - (i >> 3)] |= 1 << (i & 7)
+		}
+	}
+	return masks
+}
+
+// numPhases masks in a row to a phase string; null unless every switch is on exactly one phase
+function masksToPhases(masks) {
+	var phases = ""
+	for (let i = 0; i < numSwitches; i++) {
+		var phase = null
+		for (let p = 0; p < numPhases; p++) {
+			if ((masks[p * maskBytes + maskBytes - 1 - (i >> 3)] >> (i & 7)) & 1) {
+				if (phase !== null) {
+					return null
+				}
+				phase = p + 1
+			}
+		}
+		if (phase === null) {
+			return null
+		}
+		phases += phase
+	}
+	return phases
+}
+
+// ********************************************** FRAMING *********************************************** //
+
+// build a frame: length, id, command or status, payload
+function frame(id, code, payload) {
+	const buf = Buffer.alloc(2 + 5 + payload.length)
+	buf.writeUInt16BE(5 + payload.length, 0)
+	buf.writeUInt32BE(id >>> 0, 2)
+	buf[6] = code
+	payload.copy(buf, 7)
+	return buf
+}
+
+// split the frames out of the bytes received so far; calls onFrame(id, code, payload) for each complete one
+// and returns the bytes left over (the start of the next frame), or null if the stream is corrupt
+function parseFrames(buf, onFrame) {
+	var offset = 0
+	while (buf.length - offset >= 2) {
+		const len = buf.readUInt16BE(offset)
+		if (len < 5 || len > MAX_FRAME) {
+			return null
+		}
+		if (buf.length - offset < 2 + len) {
+			break
+		}
+		onFrame(buf.readUInt32BE(offset + 2), buf[offset + 6], buf.subarray(offset + 7, offset + 2 + len))
+		offset += 2 + len
+	}
+	return buf.subarray(offset)
+}
+
+// ********************************************** COMMANDS ********************************************** //
+
+// serial interface arguments, state field and payload length of each device command
+const commands = {
+	[CMD_SW_GET]: { field: "switches", payloadLen: 0, args: () => ["SW?"] },
+	[CMD_SW_SET]: { field: "switches", payloadLen: maskBytes, args: payload => ["SW", maskToSwitches(payload)] },
+	[CMD_PHASE_GET]: { field: "phases", payloadLen: 0, args: () => ["PHASE?"] },
+	[CMD_PHASE_SET]: { field: "phases", payloadLen: numPhases * maskBytes, args: payload => {
+		const phases = masksToPhases(payload)
+		return (phases === null) ? null : ["PHASE", phases]
+	} },
+	[CMD_ZCS_GET]: { field: "zcs", payloadLen: 0, args: () => ["ZCS?"] },
+	[CMD_ZCS_SET]: { field: "zcs", payloadLen: 1, args: payload => (payload[0] > 1) ? null : ["ZCS", payload[0] ? "ON" : "OFF"] },
+}
+
+// encode the state field value the serial interface reported
+function encodeField(field, value) {
+	if (field === "switches") {
+		return switchesToMask(value)
+	} else if (field === "phases") {
+		return phasesToMasks(value)
+	}
+	return Buffer.from([value === "1" ? 1 : 0])
+}
+
+// reads of each command that are waiting for the device: { args, result promise }
+// the device runs one command at a time, so no write can complete between such a read reaching the board and
+// the read completing; a read arriving in the meantime can therefore share its result instead of queueing again
+var readsInFlight = new Map()
+
+// run a read, sharing the result of the same read if one is already waiting for the device
+function read(runCmd, args) {
+	const key = args[0]
+	if (!readsInFlight.has(key)) {
+		readsInFlight.set(key, runCmd(args, null).finally(() => readsInFlight.delete(key)))
+	}
+	return readsInFlight.get(key)
+}
+
+// run one request and resolve to the reply frame
+// runCmd is the API server's (queues the command on the device and records the state it reports), and
+// cachedState(field) returns the state to answer a query with without asking the board, or null
+async function handle(runCmd, cachedState, id, code, payload) {
+	const reply = (status, data) => frame(id, status, Buffer.isBuffer(data) ? data : Buffer.from(data))
+	if (code === CMD_GEOMETRY) {
+		return reply(STATUS_OK, Buffer.from([numSwitches, numPhases, maskBytes]))
+	}
+	const command = commands[code]
+	if (command === undefined) {
+		return reply(STATUS_BAD_REQUEST, `Invalid command ${code}`)
+	}
+	if (payload.length !== command.payloadLen) {
+		return reply(STATUS_BAD_REQUEST, `Command ${code} takes ${command.payloadLen} payload bytes, got ${payload.length}`)
+	}
+	const args = command.args(payload)
+	if (args === null) {
+		return reply(STATUS_BAD_REQUEST, "Invalid payload")
+	}
+
+	const isRead = (command.payloadLen === 0)
+	if (isRead && cachedState(command.field) !== null) {
+		return reply(STATUS_OK, encodeField(command.field, cachedState(command.field)))
+	}
+	const result = isRead ? await read(runCmd, args) : await runCmd(args, null)
+	if (result.error !== null) {
+		return reply(STATUS_DEVICE_ERROR, result.error.message)
+	}
+	var parsed = null
+	try {
+		parsed = JSON.parse(result.stdout)
+	} catch (error) {
+		return reply((result.code === 3 || result.code === 4) ? STATUS_DEVICE_ERROR : STATUS_BAD_REQUEST, result.stdout.trim())
+	}
+	if (parsed.status === "OK" && typeof parsed[command.field] === "string") {
+		return reply(STATUS_OK, encodeField(command.field, parsed[command.field]))
+	}
+	const status = (parsed.status === "Request Timeout") ? STATUS_TIMEOUT : (parsed.status === "Bad Request") ? STATUS_BAD_REQUEST : STATUS_DEVICE_ERROR
+	return reply(status, `${parsed.status}: ${parsed.msg}`)
+}
+
+// serve one client connection
+function serve(runCmd, cachedState, socket) {
+	var pending = Buffer.alloc(0)
+	socket.setNoDelay(true)
+	socket.on("data", data => {
+		pending = parseFrames(pending.length > 0 ? Buffer.concat([pending, data]) : data, (id, code, payload) => {
+			// the payload is a view of the receive buffer; copy it before anything else is received into it
+			handle(runCmd, cachedState, id, code, Buffer.from(payload)).then(reply => {
+				if (!socket.destroyed) {
+					socket.write(reply)
+				}
+			})
+		})
+		if (pending === null) {
+			logger.warn("binary API: bad frame length, closing connection")
+			socket.destroy()
+		}
+	})
+	socket.on("error", () => {})
+}
+
+// start listening (does nothing if BINARY_API_LISTEN is empty)
+function start(runCmd, cachedState) {
+	if (listenAddress === "") {
+		return
+	}
+	const server = net.createServer(socket => serve(runCmd, cachedState, socket))
+	server.on("error", error => logger.error(`binary API could not listen on ${listenAddress}`, { error: error.message }))
+	if (listenAddress.startsWith("/")) {
+		// a socket file left behind by an earlier run would make listen fail
+		try {
+			if (fs.statSync(listenAddress).isSocket()) {
+				fs.unlinkSync(listenAddress)
+			}
+		} catch (error) {
+			// nothing there yet
+		}
+		server.listen(listenAddress, () => logger.info(`binary API listening on ${listenAddress}`))
+	} else {
+		const colon = listenAddress.lastIndexOf(":")
+		const host = (colon === -1) ? "127.0.0.1" : listenAddress.substring(0, colon)
+		server.listen(parseInt(listenAddress.substring(colon + 1)), host, () => logger.info(`binary API listening on ${host}:${listenAddress.substring(colon + 1)}`))
+	}
+}
+
+module.exports = {
+	CMD_SW_GET,
+	CMD_SW_SET,
+	CMD_PHASE_GET,
+	CMD_PHASE_SET,
+	CMD_ZCS_GET,
+	CMD_ZCS_SET,
+	CMD_GEOMETRY,
+	STATUS_OK,
+	STATUS_BAD_REQUEST,
+	STATUS_TIMEOUT,
+	STATUS_DEVICE_ERROR,
+	switchesToMask,
+	maskToSwitches,
+	phasesToMasks,
+	masksToPhases,
+	frame,
+	parseFrames,
+	start,
+}
@@ -0,0 +1,201 @@
+// Reference client for the binary API (see binary_api.js for the protocol), usable as a module or from the command line:
+//	node binary_client.js sw 101000000000000001	set the switches (prints the state read back)
+//	node binary_client.js sw?			also phase <phases>, phase?, zcs on|off, zcs?, geometry
+//	node binary_client.js bench --count 500 --pipeline 16 --write-ratio 0.2
+// bench runs the same mix of switch reads and writes through the binary API and then through the JSON API
+// (with --pipeline requests in flight on each) and compares their throughput and latency.
+// --binary sets the binary API address (Unix socket path or [host:]port) and --url the JSON API.
+
+const net = require('net')
+const http = require('http')
+const binaryApi = require('./binary_api')
+
+// define the default options (each can be overridden with --name value)
+var options = {
+	"binary": process.env.BINARY_API_LISTEN || "127.0.0.1:6002",
+	"url": "http://localhost:6001",
+	"count": 200,			// requests per API in bench
+	"pipeline": 8,			// requests in flight at once in bench
+	"write-ratio": 0.2,		// fraction of bench requests that are writes
+}
+var positional = []
+for (let i = 2; i < process.argv.length; i++) {
+	if (process.argv[i].startsWith("--") && i + 1 < process.argv.length) {
+		const name = process.argv[i].replace(/^--/, "")
+		options[name] = (name === "binary" || name === "url") ? process.argv[i + 1] : parseFloat(process.argv[i + 1])
+		i++
+	} else {
+		positional.push(process.argv[i])
+	}
+}
+
+// ********************************************** CLIENT ************************************************ //
+
+// one connection to the binary API; request() may be called any number of times without waiting
+class BinaryClient {
+	constructor(address) {
+		this.nextId = 1
+		this.waiting = new Map()
+		this.pending = Buffer.alloc(0)
+		const colon = address.lastIndexOf(":")
+		this.socket = address.startsWith("/") ? net.connect(address) :
+			net.connect(parseInt(address.substring(colon + 1)), (colon === -1) ? "127.0.0.1" : address.substring(0, colon))
+		this.socket.setNoDelay(true)
+		this.connected = new Promise((resolve, reject) => {
+			this.socket.once("connect", resolve)
+			this.socket.once("error", reject)
+		})
+		this.socket.on("data", data => {
+			this.pending = binaryApi.parseFrames(Buffer.concat([this.pending, data]), (id, status, payload) => {
+				const resolve = this.waiting.get(id)
+				this.waiting.delete(id)
+				if (resolve !== undefined) {
+					resolve({ status: status, payload: Buffer.from(payload) })
+				}
+			})
+		})
+	}
+
+	// send one command; resolves to { status, payload }
+	request(command, payload = Buffer.alloc(0)) {
+		const id = this.nextId++
+		return new Promise(resolve => {
+			this.waiting.set(id, resolve)
+			this.socket.write(binaryApi.frame(id, command, payload))
+		})
+	}
+
+	close() {
+		this.socket.end()
+	}
+}
+
+// the state a reply carries, in the same form as the JSON API (or the error message)
+function describe(command, reply) {
+	if (reply.status !== binaryApi.STATUS_OK) {
+		return { status: reply.status, msg: reply.payload.toString() }
+	}
+	switch (command) {
+		case binaryApi.CMD_SW_GET:
+		case binaryApi.CMD_SW_SET:
+			return { status: "OK", switches: binaryApi.maskToSwitches(reply.payload) }
+		case binaryApi.CMD_PHASE_GET:
+		case binaryApi.CMD_PHASE_SET:
+			return { status: "OK", phases: binaryApi.masksToPhases(reply.payload) }
+		case binaryApi.CMD_ZCS_GET:
+		case binaryApi.CMD_ZCS_SET:
+			return { status: "OK", zcs: `${reply.payload[0]}` }
+		default:
+			return { status: "OK", switches: reply.payload[0], phases: reply.payload[1], mask_bytes: reply.payload[2] }
+	}
+}
+
+// ********************************************** BENCH ************************************************* //
+
+// random switch state for a write
+function randomSwitches(numSwitches) {
+	var switches = ""
+	for (let i = 0; i < numSwitches; i++) {
+		switches += Math.random() < 0.5 ? "1" : "0"
+	}
+	return switches
+}
+
+// JSON API requests reuse their connections, as a machine client would
+const httpAgent = new http.Agent({ keepAlive: true, maxSockets: 64 })
+
+// JSON API request; resolves to true if it succeeded
+function httpRequest(path) {
+	return new Promise(resolve => {
+		http.get(options.url + path, { agent: httpAgent }, res => {
+			var body = ""
+			res.on("data", data => body += data)
+			res.on("end", () => resolve(res.statusCode === 200 && body.includes('"OK"')))
+		}).on("error", () => resolve(false))
+	})
+}
+
+// run count operations with pipeline in flight at a time; op(write) resolves to true on success
+async function runBench(name, op) {
+	var latencies = []
+	var errors = 0
+	var issued = 0
+	const started = process.hrtime.bigint()
+	async function worker() {
+		while (issued < options.count) {
+			issued++
+			const t0 = process.hrtime.bigint()
+			if (!await op(Math.random() < options["write-ratio"])) {
+				errors++
+			}
+			latencies.push(Number(process.hrtime.bigint() - t0) / 1e6)
+		}
+	}
+	await Promise.all(Array.from({ length: options.pipeline }, worker))
+	const elapsedS = Number(process.hrtime.bigint() - started) / 1e9
+	latencies.sort((a, b) => a - b)
+	const percentile = p => latencies[Math.min(latencies.length - 1, Math.floor(p * latencies.length))].toFixed(2)
+	return { api: name, requests: latencies.length, errors: errors, per_second: +(latencies.length / elapsedS).toFixed(1), p50_ms: +percentile(0.5), p99_ms: +percentile(0.99) }
+}
+
+async function bench() {
+	const client = new BinaryClient(options.binary)
+	await client.connected
+	const geometry = await client.request(binaryApi.CMD_GEOMETRY)
+	const numSwitches = geometry.payload[0]
+
+	const binary = await runBench("binary", async write => {
+		const reply = write ? await client.request(binaryApi.CMD_SW_SET, binaryApi.switchesToMask(randomSwitches(numSwitches))) :
+			await client.request(binaryApi.CMD_SW_GET)
+		return reply.status === binaryApi.STATUS_OK
+	})
+	client.close()
+	const json = await runBench("json", write => httpRequest(write ? `/api/v1/switches?values=${randomSwitches(numSwitches)}` : "/api/v1/switches/status"))
+	httpAgent.destroy()
+
+	console.log(JSON.stringify({ binary: binary, json: json, speedup: +(binary.per_second / json.per_second).toFixed(2) }, null, 2))
+}
+
+// ********************************************** COMMAND LINE ****************************************** //
+
+// map from command line command to command id and payload encoding
+const cliCommands = {
+	"sw?": [binaryApi.CMD_SW_GET, () => Buffer.alloc(0)],
+	"sw": [binaryApi.CMD_SW_SET, arg => binaryApi.switchesToMask(arg)],
+	"phase?": [binaryApi.CMD_PHASE_GET, () => Buffer.alloc(0)],
+	"phase": [binaryApi.CMD_PHASE_SET, arg => binaryApi.phasesToMasks(arg)],
+	"zcs?": [binaryApi.CMD_ZCS_GET, () => Buffer.alloc(0)],
+	"zcs": [binaryApi.CMD_ZCS_SET, arg => Buffer.from([arg === "on" ? 1 : 0])],
+	"geometry": [binaryApi.CMD_GEOMETRY, () => Buffer.alloc(0)],
+}
+
+async function main() {
+	if (positional[0] === "bench") {
+		await bench()
+		return
+	}
+	const cliCommand = cliCommands[positional[0]]
+	if (cliCommand === undefined) {
+		console.log(`usage: node binary_client.js <${Object.keys(cliCommands).join("|")}> [value] | bench [--count n] [--pipeline n]`)
+		process.exitCode = 1
+		return
+	}
+	const client = new BinaryClient(options.binary)
+	await client.connected
+	const reply = await client.request(cliCommand[0], cliCommand[1](positional[1] || ""))
+	console.log(JSON.stringify(describe(cliCommand[0], reply)))
+	process.exitCode = (reply.status === binaryApi.STATUS_OK) ? 0 : 1
+	client.close()
+}
+
+if (require.main === module) {
+	main().catch(error => {
+		console.log(`error: ${error.message}`)
+		process.exitCode = 1
+	})
+}
+
+module.exports = {
+	BinaryClient,
+	describe,
+}
@@ -0,0 +1,58 @@
+// Reports who currently owns the load bank device.
+// The serial interface takes an flock on a per-device lock file for every command (released by the
+// kernel when the process exits, however it exits) and writes its pid, command and start time into it.
+
+const fs = require('fs')
+const path = require('path')
+
+// define the lock file of the device the serial interface talks to (matches LBIO_LOCK_DIR in load_bank_io.h)
+const lockDir = "/tmp"
+const deviceName = process.env.LOAD_BANK_DEVICE || "/dev/ttyUSB0"
+const lockFile = path.join(lockDir, `load_bank.${path.basename(deviceName)}.lock`)
+
+// true if a process with this pid exists
+function processAlive(pid) {
+	try {
+		process.kill(pid, 0)
+		return true
+	} catch (error) {
+		return error.code === "EPERM"
+	}
+}
+
+// current holder of the device as recorded in the lock file
+// a record left behind by a process that no longer exists is reported as stale (its lock is already gone)
+// a record that cannot be read (eg. caught part way through being written) says nothing either way, so held is null
+function holder() {
+	var contents = ""
+	try {
+		contents = fs.readFileSync(lockFile, "utf8")
+	} catch (error) {
+		contents = ""
+	}
+	var record = null
+	try {
+		if (contents !== "") {
+			record = JSON.parse(contents)
+		}
+	} catch (error) {
+		return { status: "OK", device: deviceName, held: null, holder: null, msg: "Unreadable holder record", record: contents }
+	}
+
+	if (record === null) {
+		return { status: "OK", device: deviceName, held: false, holder: null }
+	}
+	const alive = processAlive(record.pid)
+	return {
+		status: "OK",
+		device: deviceName,
+		held: alive,
+		stale: !alive,
+		holder: record,
+		held_ms: alive ? Date.now() - record.since : null,
+	}
+}
+
+module.exports = {
+	holder,
+}
@@ -0,0 +1,161 @@
+// Serialises access to the load bank: only one serial interface process runs at a time,
+// and queued commands are started in priority order (lower number first) so that user
+// requests always go ahead of background work such as state polling, and safety actions
+// such as dead-man load shedding go ahead of everything.
+
+const { spawn } = require("child_process")
+const tracing = require('./tracing')
+const deviceState = require('./device_state')
+const transport = require('./transport')
+const zcsStats = require('./zcs_stats')
+const logger = require('./logger')
+
+// define the priorities commands can be submitted with
+const PRIORITY_SAFETY = 0
+const PRIORITY_USER = 1
+const PRIORITY_BACKGROUND = 2
+const NUM_PRIORITIES = 3
+
+// define how long a serial interface process may run before it is killed
+// (longer than its own device lock timeout plus the 10 s zero-crossing timeout of the board)
+const commandTimeoutMs = parseInt(process.env.SERIAL_TIMEOUT_MS || 30000)
+
+// one FIFO of pending jobs per priority
+var pending = []
+for (let i = 0; i < NUM_PRIORITIES; i++) {
+	pending.push([])
+}
+
+// the job currently running on the device (null when idle)
+var running = null
+
+// path of the serial interface program to run for each command
+var serialInterfacePath = null
+
+// set the path of the serial interface program
+function init(path) {
+	serialInterfacePath = path
+}
+
+// queue the serial interface to be run with args; resolves to { code, stdout, stderr, error, started, queue_ms, run_ms }
+// (started is false for a job cancelled before it ran, which therefore never reached the board)
+// if trace is given, the time spent queued and running is recorded as spans of that trace
+// cmd runs a different program that needs the device (eg. load_bank_group) instead of the serial interface
+// path pins the command to one path to the board (for health checks); otherwise the active path is used
+function submit(args, priority = PRIORITY_USER, trace = null, cmd = null, path = null) {
+	return new Promise((resolve) => {
+		pending[priority].push({ cmd: cmd || serialInterfacePath, args: args, resolve: resolve, trace: trace, path: path, queuedAt: tracing.nowUs() })
+		runNext()
+	})
+}
+
+// true if a user command is running or waiting to run
+function userBusy() {
+	return (running !== null && running.priority === PRIORITY_USER) || pending[PRIORITY_USER].length > 0
+}
+
+// true if a write command (one that may be waiting on a zero crossing) is running or waiting to run
+function writeInFlight() {
+	const isWrite = job => deviceState.isWrite(job.args)
+	return (running !== null && isWrite(running)) || pending.some(q => q.some(isWrite))
+}
+
+// command currently running on the device, or null
+function runningArgs() {
+	return running !== null ? running.args : null
+}
+
+// drop every pending (not yet started) job for which drop(args) is true; they resolve with an error saying why
+function cancelPending(drop, reason) {
+	for (let priority = 0; priority < NUM_PRIORITIES; priority++) {
+		pending[priority] = pending[priority].filter(job => {
+			if (!drop(job.args)) {
+				return true
+			}
+			job.resolve({ code: null, stdout: "", stderr: "", error: new Error(reason), started: false })
+			return false
+		})
+	}
+}
+
+// true if nothing is running or waiting to run
+function idle() {
+	return running === null && pending.every(q => q.length === 0)
+}
+
+// start the highest priority pending job if the device is free
+function runNext() {
+	if (running !== null) {
+		return
+	}
+	for (let priority = 0; priority < NUM_PRIORITIES; priority++) {
+		if (pending[priority].length > 0) {
+			running = pending[priority].shift()
+			running.priority = priority
+			start(running)
+			return
+		}
+	}
+}
+
+// run one job and resolve it with everything the child process printed
+function start(job) {
+	var stdout = ""
+	var stderr = ""
+	var error = null
+	var startedAt = tracing.nowUs()
+	tracing.span(job.trace, "queue_wait", job.queuedAt, startedAt)
+	var path = job.path || transport.active()
+	var ls = spawn(job.cmd, job.args, { env: Object.assign({}, tracing.childEnv(job.trace), transport.env(path)) })
+	tracing.span(job.trace, "spawn", startedAt, tracing.nowUs())
+
+	// a hung process is killed; the kernel then releases its device lock, so nothing is left stuck behind it
+	const timer = setTimeout(() => {
+		error = new Error(`serial interface timed out after ${commandTimeoutMs} ms`)
+		ls.kill("SIGKILL")
+	}, commandTimeoutMs)
+
+	ls.stdout.on("data", data => {
+		stdout += data
+	});
+
+	ls.stderr.on("data", data => {
+		stderr += data
+	});
+
+	ls.on('error', (err) => {
+		error = err
+	});
+
+	// 'close' follows 'error' when the process could not be spawned, so finish there in both cases
+	ls.on("close", code => {
+		clearTimeout(timer)
+		tracing.span(job.trace, "serial_interface", startedAt, tracing.nowUs(), { args: job.args.join(" "), code: code, path: path.name })
+
+		// if the path failed in a way that makes it safe to do so, run the same job again over the next path
+		if (job.path === null && transport.report(path, code, deviceState.isWrite(job.args))) {
+			logger.warn("path failed, retrying on the next one", { path: path.name, code: code, args: job.args.join(" "), next: transport.active().name })
+			start(job)
+			return
+		}
+		zcsStats.record(job.args, stdout)
+		running = null
+		const finishedAt = tracing.nowUs()
+		job.resolve({ code: code, stdout: stdout, stderr: stderr, error: error, started: true, queue_ms: (startedAt - job.queuedAt) / 1000, run_ms: (finishedAt - startedAt) / 1000 })
+		runNext()
+	});
+}
+
+module.exports = {
+	PRIORITY_SAFETY,
+	PRIORITY_USER,
+	PRIORITY_BACKGROUND,
+	commandTimeoutMs,
+	init,
+	submit,
+	userBusy,
+	runningArgs,
+	cancelPending,
+	writeInFlight,
+	idle,
+}
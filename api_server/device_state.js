@@ -0,0 +1,186 @@
+// Keeps track of the load bank state as last reported by the board (the snapshot) and as
+// last set through this API (the commanded state), and flags any difference between the two.
+// Every response from the serial interface is passed through record() to keep both up to date.
+// The generation counter goes up on every change to the snapshot, so clients can tell whether
+// anything changed since they last looked (ETags, long-polls) without asking the board.
+
+// latest state reported by the board; null fields have not been seen yet
+var snapshot = { switches: null, phases: null, zcs: null, updated: null }
+
+// state last successfully written through the API
+var commanded = { switches: null, phases: null, zcs: null }
+
+// map from the command sent to the serial interface to the state field it reads or writes
+const commandFields = {
+	"SW?": "switches",
+	"SW": "switches",
+	"SWPATCH": "switches",
+	"PHASE?": "phases",
+	"PHASE": "phases",
+	"PHASEPATCH": "phases",
+	"ZCS?": "zcs",
+	"ZCS": "zcs",
+}
+
+// commands that report several fields at once (the full state query)
+const commandFieldLists = {
+	"STATE?": ["switches", "phases", "zcs"],
+}
+
+// incremented every time the snapshot changes
+var generation = 0
+
+// fields restored from a saved snapshot that the board has not confirmed since
+var unverified = new Set()
+
+// the command in args, after any leading options and their values (eg. the "-d 50" of a group command)
+function commandOf(args) {
+	var i = 0
+	while (i < args.length && args[i].startsWith("-")) {
+		i += 2
+	}
+	return args[i]
+}
+
+// true if args is a command that changes the state of the board (on its own or as part of a group command)
+function isWrite(args) {
+	const command = commandOf(args)
+	return commandFields[command] !== undefined && !command.endsWith("?")
+}
+
+// listeners called with (field, oldValue, newValue) whenever the snapshot changes, and when the board first
+// confirms a field restored from a saved snapshot (oldValue is then null, as for a field not seen before)
+var changeListeners = []
+
+// register a listener for changes to the snapshot
+function onChange(listener) {
+	changeListeners.push(listener)
+}
+
+// update the snapshot (and the commanded state for writes) from a serial interface response
+// returns true if the board reported a state different from the snapshot
+function record(args, stdout) {
+	var fields = commandFieldLists[args[0]] || [commandFields[args[0]]]
+	if (fields[0] === undefined) {
+		return false
+	}
+
+	var result
+	try {
+		result = JSON.parse(stdout)
+	} catch (error) {
+		return false
+	}
+	if (result.status !== "OK") {
+		return false
+	}
+
+	var changed = false
+	for (const field of fields) {
+		if (result[field] === undefined) {
+			continue
+		}
+
+		// a successful write reports the state read back afterwards, which is now the commanded state
+		var value = result[field]
+		if (isWrite(args)) {
+			commanded[field] = value
+		}
+
+		var old = snapshot[field]
+		var wasUnverified = unverified.delete(field)
+		snapshot[field] = value
+		snapshot.updated = Date.now()
+		if (old !== value) {
+			generation++
+			changed = true
+		}
+		if (old !== value || wasUnverified) {
+			changeListeners.slice().forEach(listener => listener(field, wasUnverified ? null : old, value))
+		}
+	}
+	return changed
+}
+
+// record a write of value by command (SW or PHASE) that the board acknowledged without reading the state back
+// (eg. as one device of a group command), as record() does for the serial interface's response to the same write
+function recordAcknowledged(command, value) {
+	return record([command, value], JSON.stringify({ status: "OK", [commandFields[command]]: value }))
+}
+
+// take over a snapshot saved by an earlier run (fields missing from saved stay null), keeping its generation
+// so that ETags handed out before a restart stay valid; the restored fields count as unverified until the
+// board reports them again, and listeners (eg. accounting) only hear of them then, since the state may have
+// changed while the server was down
+function restore(saved, savedGeneration) {
+	generation = Math.max(generation, savedGeneration)
+	for (const field of ["switches", "phases", "zcs"]) {
+		if (saved[field] === null || saved[field] === undefined || snapshot[field] !== null) {
+			continue
+		}
+		snapshot[field] = saved[field]
+		unverified.add(field)
+	}
+}
+
+// true if the snapshot value of field has been reported by the board since startup
+function isVerified(field) {
+	return !unverified.has(field)
+}
+
+// current generation of the snapshot
+function getGeneration() {
+	return generation
+}
+
+// entity tag for the current snapshot
+function etag() {
+	return `"g${generation}"`
+}
+
+// resolve once the generation differs from since, or after timeoutMs
+function waitForChange(since, timeoutMs) {
+	return new Promise(resolve => {
+		if (generation !== since) {
+			resolve()
+			return
+		}
+		var done = false
+		const timer = setTimeout(finish, timeoutMs)
+		function finish() {
+			if (!done) {
+				done = true
+				clearTimeout(timer)
+				changeListeners.splice(changeListeners.indexOf(finish), 1)
+				resolve()
+			}
+		}
+		changeListeners.push(finish)
+	})
+}
+
+// fields whose reported state differs from what was last commanded through the API
+function drift() {
+	var fields = []
+	for (const field of ["switches", "phases", "zcs"]) {
+		if (commanded[field] !== null && snapshot[field] !== null && commanded[field] !== snapshot[field]) {
+			fields.push(field)
+		}
+	}
+	return fields
+}
+
+module.exports = {
+	snapshot,
+	commanded,
+	isWrite,
+	onChange,
+	record,
+	recordAcknowledged,
+	restore,
+	isVerified,
+	getGeneration,
+	etag,
+	waitForChange,
+	drift,
+}
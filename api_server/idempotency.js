@@ -0,0 +1,85 @@
+// Idempotency keys for write requests. A client that gives a write a key (the Idempotency-Key header, or
+// ?idempotency_key=) and then retries it, eg. after timing out during a long zero-crossing wait, gets the
+// answer of the first attempt instead of having the command run (and wait for a zero crossing) again.
+// A retry that arrives while the first attempt is still running waits for it and gets the same answer.
+// Keys are remembered for ttlMs after their write completes, and at most maxEntries completed keys are kept.
+
+// define how many completed keys are remembered and for how long
+const maxEntries = parseInt(process.env.IDEMPOTENCY_CACHE_SIZE || 256)
+const ttlMs = parseInt(process.env.IDEMPOTENCY_TTL_MS || 600000)
+
+// longest key accepted
+const maxKeyLength = 128
+
+// entries by key, oldest first: { request, response (promise), completed (time, or null while running) }
+var entries = new Map()
+
+var replays = 0
+var conflicts = 0
+
+// the idempotency key of a request, or null if it has none
+function keyOf(req, url) {
+	const key = req.headers['idempotency-key'] || url.searchParams.get("idempotency_key")
+	return (key && key.length <= maxKeyLength) ? key : null
+}
+
+// forget expired keys, then the oldest completed keys while there are too many
+// (keys still running are never forgotten, since a retry of one would run the command a second time)
+function prune() {
+	const now = Date.now()
+	for (const [key, entry] of entries) {
+		if (entry.completed !== null && (now - entry.completed > ttlMs || entries.size > maxEntries)) {
+			entries.delete(key)
+		}
+	}
+}
+
+// start a write, turning a failure to start it (a rejected promise) into a retryable 500 response
+function settle(start) {
+	return Promise.resolve().then(start).catch(error => ({ statusCode: 500, body: `${error.message}\n`, retryable: true }))
+}
+
+// answer a write identified by key (null for none) and request (the command it runs)
+// start() starts the write and resolves to the response { statusCode, body, retryable }; a retryable response
+// (the command never reached the board) is not remembered, so a retry runs it again
+// resolves to { response, replayed }, or { conflict: true } if the key was used before for a different request
+function run(key, request, start) {
+	if (key === null) {
+		return settle(start).then(response => ({ response: response, replayed: false }))
+	}
+	prune()
+	const existing = entries.get(key)
+	if (existing !== undefined) {
+		if (existing.request !== request) {
+			conflicts++
+			return Promise.resolve({ conflict: true })
+		}
+		replays++
+		return existing.response.then(response => ({ response: response, replayed: true }))
+	}
+
+	const entry = { request: request, response: settle(start), completed: null }
+	entries.set(key, entry)
+	entry.response.then(response => {
+		entry.completed = Date.now()
+		if (response.retryable && entries.get(key) === entry) {
+			entries.delete(key)
+		}
+	})
+	return entry.response.then(response => ({ response: response, replayed: false }))
+}
+
+// report on the cache
+function status() {
+	var running = 0
+	for (const entry of entries.values()) {
+		running += (entry.completed === null) ? 1 : 0
+	}
+	return { status: "OK", keys: entries.size, running: running, max_keys: maxEntries, ttl_ms: ttlMs, replays: replays, conflicts: conflicts }
+}
+
+module.exports = {
+	keyOf,
+	run,
+	status,
+}
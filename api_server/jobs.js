@@ -0,0 +1,87 @@
+// Asynchronous write jobs: a SW or PHASE write can be accepted straight away with a job id,
+// and the client checks /api/v1/jobs/{id} (optionally long-polling with ?wait=ms) for the
+// result instead of holding its HTTP connection open through the zero-crossing wait.
+
+// define how many finished jobs are remembered (oldest are forgotten first)
+const maxJobs = parseInt(process.env.MAX_JOBS || 256)
+
+// all remembered jobs by id, in creation order
+var jobs = new Map()
+var nextJobId = 1
+
+// start tracking the command args as a job that completes when promise resolves with the serial interface output
+function create(args, promise) {
+	const job = {
+		id: `${nextJobId++}`,
+		args: args,
+		state: "running",
+		created: Date.now(),
+		finished: null,
+		result: null,
+		waiters: [],
+	}
+	jobs.set(job.id, job)
+
+	// forget the oldest finished jobs once there are too many
+	for (const [id, old] of jobs) {
+		if (jobs.size <= maxJobs) {
+			break
+		}
+		if (old.state === "done") {
+			jobs.delete(id)
+		}
+	}
+
+	promise.then(output => {
+		try {
+			job.result = JSON.parse(output)
+		} catch (error) {
+			job.result = { status: "Internal Server Error", msg: `${output}` }
+		}
+		job.state = "done"
+		job.finished = Date.now()
+		job.waiters.forEach(waiter => waiter())
+		job.waiters = []
+	})
+	return job
+}
+
+// the job with the given id, or undefined
+function get(id) {
+	return jobs.get(id)
+}
+
+// resolve once the job is done or timeoutMs has passed, whichever comes first
+function wait(job, timeoutMs) {
+	return new Promise(resolve => {
+		if (job.state === "done" || timeoutMs <= 0) {
+			resolve()
+			return
+		}
+		const timer = setTimeout(resolve, timeoutMs)
+		job.waiters.push(() => {
+			clearTimeout(timer)
+			resolve()
+		})
+	})
+}
+
+// the representation of a job returned by the API
+function describe(job) {
+	return {
+		status: "OK",
+		job: job.id,
+		command: job.args.join(" "),
+		state: job.state,
+		created: job.created,
+		finished: job.finished,
+		result: job.result,
+	}
+}
+
+module.exports = {
+	create,
+	get,
+	wait,
+	describe,
+}
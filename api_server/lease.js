@@ -0,0 +1,137 @@
+// Dead-man lease: a controlling client renews a heartbeat, and if it stops (because the client
+// crashed mid-test, say) the bank is switched all-off ahead of anything else in the device queue.
+// Writes still waiting in the queue at that point are dropped so they cannot turn load back on.
+// The first all-off attempt can only be held up by the command already running on the device
+// (which the queue kills after commandTimeoutMs), and may itself run once over every path to the
+// board, so it completes within (1 + number of paths) * commandTimeoutMs plus timer slack.
+// The shed is only done once the board reads back every switch off; until then it is retried
+// every shedRetryMs and reported as failing in status(). The measured time of every shed is reported too.
+// Only the holder of the lease can renew or release it.
+
+const deviceQueue = require('./device_queue')
+const deviceState = require('./device_state')
+const transport = require('./transport')
+const logger = require('./logger')
+
+// define the default lease length and the all-off switch state
+const defaultTtlMs = parseInt(process.env.LEASE_TTL_MS || 10000)
+const allOff = "0".repeat(parseInt(process.env.LOAD_BANK_NUM_SWITCHES || 18))
+
+// define how long to wait before trying a failed shed again
+const shedRetryMs = parseInt(process.env.LEASE_SHED_RETRY_MS || 500)
+
+var lease = null		// { holder, ttlMs, expires, timer } while a lease is active
+var lastShed = null		// report of the most recent shed
+var maxShedMs = 0		// worst expiry-to-all-off time measured so far
+
+// the upper bound on the time from expiry to the end of the first all-off attempt
+// (the command running at expiry, then the all-off itself, which the queue may run once over each path)
+function boundMs() {
+	return (1 + transport.status().paths.length) * deviceQueue.commandTimeoutMs + 100
+}
+
+// the lease state with an error, for a request by someone other than the holder
+function notHolder(holder) {
+	return Object.assign(status(), { status: "Conflict", msg: `Lease is held by ${lease.holder}, not ${holder}` })
+}
+
+// start or renew the lease for ttlMs (only the current holder can renew an active lease)
+function renew(holder, ttlMs) {
+	ttlMs = (ttlMs > 0) ? ttlMs : defaultTtlMs
+	if (lease !== null) {
+		if (lease.holder !== holder) {
+			return notHolder(holder)
+		}
+		clearTimeout(lease.timer)
+	}
+	lease = { holder: holder, ttlMs: ttlMs, expires: Date.now() + ttlMs, timer: setTimeout(expire, ttlMs) }
+	return status()
+}
+
+// end the lease without shedding load (only the holder can)
+function release(holder) {
+	if (lease !== null) {
+		if (lease.holder !== holder) {
+			return notHolder(holder)
+		}
+		clearTimeout(lease.timer)
+		lease = null
+	}
+	return status()
+}
+
+// true if an all-off result shows the board read back every switch off
+function shedDone(result) {
+	if (result.error !== null || result.code !== 0) {
+		return false
+	}
+	try {
+		const reply = JSON.parse(result.stdout)
+		return reply.status === "OK" && reply.switches === allOff
+	} catch (error) {
+		return false
+	}
+}
+
+// the lease ran out: switch everything off before anything else gets to the device, and keep trying until it is
+async function expire() {
+	const expiredLease = lease
+	lease = null
+	if (lastShed !== null && lastShed.completed_at === null) {
+		// an earlier shed is still retrying, and will not stop until everything is off
+		logger.warn("lease expired while the last shed is still failing", { holder: expiredLease.holder })
+		return
+	}
+	const shed = {
+		holder: expiredLease.holder,
+		expired_at: expiredLease.expires,
+		timer_fired_at: Date.now(),
+		in_flight_at_expiry: deviceQueue.runningArgs() !== null ? deviceQueue.runningArgs().join(" ") : null,
+		attempts: 0,
+		completed_at: null,
+		latency_ms: null,
+		result: null,
+	}
+	lastShed = shed
+	logger.warn("lease expired, switching all off", { holder: shed.holder })
+
+	while (true) {
+		// writes queued since the last attempt could turn load back on, so they are dropped each time
+		deviceQueue.cancelPending(args => deviceState.isWrite(args), "cancelled: dead-man lease expired and load was shed")
+		const result = await deviceQueue.submit(["SW", allOff], deviceQueue.PRIORITY_SAFETY)
+		deviceState.record(["SW", allOff], result.stdout)
+		shed.attempts++
+		shed.result = result.error !== null ? result.error.message : result.stdout.trim()
+		if (shedDone(result)) {
+			break
+		}
+		logger.error("load shed failed, retrying", { holder: shed.holder, attempts: shed.attempts, code: result.code, result: shed.result })
+		await new Promise(resolve => setTimeout(resolve, shedRetryMs))
+	}
+
+	shed.completed_at = Date.now()
+	shed.latency_ms = shed.completed_at - shed.expired_at
+	maxShedMs = Math.max(maxShedMs, shed.latency_ms)
+	logger.warn("load shed after lease expiry", { holder: shed.holder, latency_ms: shed.latency_ms, attempts: shed.attempts, result: shed.result })
+}
+
+// lease state for the API
+function status() {
+	return {
+		status: "OK",
+		active: lease !== null,
+		holder: lease !== null ? lease.holder : null,
+		ttl_ms: lease !== null ? lease.ttlMs : null,
+		expires_in_ms: lease !== null ? lease.expires - Date.now() : null,
+		bound_ms: boundMs(),
+		max_shed_ms: maxShedMs,
+		shed_failing: lastShed !== null && lastShed.completed_at === null && lastShed.attempts > 0,
+		last_shed: lastShed,
+	}
+}
+
+module.exports = {
+	renew,
+	release,
+	status,
+}
@@ -0,0 +1,288 @@
+// HTTP load generator and correctness checker for the /api/v1 routes.
+// Replays a mix of status reads and switch/phase writes with a given concurrency and pacing,
+// reports throughput, latency percentiles and error rates, and checks every returned
+// switches/phases value against a model of the states the bank could legally be in.
+// Meant to be run against an API server talking to load_bank_sim, eg:
+//	../serial_interface/load_bank_sim -d /tmp/ttyLOADBANK &
+//	LOAD_BANK_DEVICE=/tmp/ttyLOADBANK SERIAL_INTERFACE_PATH=../serial_interface/serial_interface node api_server.js &
+//	node load_test.js --url http://localhost:6001 --concurrency 8 --duration 30 --write-ratio 0.2
+// With --lease-check 1 it instead checks that a dead-man lease expiry drops a group write still waiting in the
+// device queue (see leaseCheck below), eg. against load_bank_sim -l 300 and a server whose LOAD_BANK_GROUP_DEVICES
+// includes the bank it controls:
+//	node load_test.js --lease-check 1 --lease-ttl 200
+
+const http = require('http')
+
+// define the default test parameters (each can be overridden with --name value)
+var options = {
+	"url": "http://localhost:6001",
+	"concurrency": 4,		// requests in flight at once
+	"rate": 0,			// total requests per second to pace to (0 = as fast as possible)
+	"duration": 10,			// seconds to run for
+	"write-ratio": 0.2,		// fraction of requests that are writes
+	"timeout": 15000,		// milliseconds before a request counts as timed out
+	"lease-check": 0,		// 1 to run the lease expiry check instead of the load test
+	"lease-ttl": 200,		// milliseconds the lease of the lease check lasts
+}
+for (let i = 2; i + 1 < process.argv.length; i += 2) {
+	const name = process.argv[i].replace(/^--/, "")
+	options[name] = (name === "url") ? process.argv[i + 1] : parseFloat(process.argv[i + 1])
+}
+
+const numSwitches = parseInt(process.env.LOAD_BANK_NUM_SWITCHES || 18)
+const numPhases = parseInt(process.env.LOAD_BANK_NUM_PHASES || 3)
+
+// ********************************************** STATE MODEL ********************************************** //
+
+// every write that has been issued for each state field, with the interval it was in flight
+// a write that failed or timed out may or may not have been applied, so it is kept as well
+var writes = { switches: [], phases: [] }
+
+// the values a read of field over [start, end] may legally return: any write that had started before the
+// read ended and that was not certainly overwritten (by a write that started after it ended) before the read began
+function legalValues(field, start, end) {
+	var values = new Set()
+	for (const w of writes[field]) {
+		if (w.start >= end) {
+			continue
+		}
+		const overwritten = writes[field].some(w2 => w2 !== w && w2.ok && w2.start > w.end && w2.end < start)
+		if (!overwritten) {
+			values.add(w.value)
+		}
+	}
+	return values
+}
+
+// forget writes that can no longer affect any read that is still to be checked
+function pruneWrites(oldestInFlight) {
+	for (const field in writes) {
+		const completed = writes[field].filter(w => w.ok && w.end < oldestInFlight)
+		if (completed.length === 0) {
+			continue
+		}
+		const latestStart = Math.max(...completed.map(w => w.start))
+		writes[field] = writes[field].filter(w => w.end >= latestStart || w.end === Infinity)
+	}
+}
+
+// ********************************************** REQUESTS ************************************************* //
+
+// random switch string, eg. "101100111000101011"
+function randomSwitches() {
+	var s = ""
+	for (let i = 0; i < numSwitches; i++) {
+		s += Math.random() < 0.5 ? "1" : "0"
+	}
+	return s
+}
+
+// random phase string, eg. "123312231123312231"
+function randomPhases() {
+	var s = ""
+	for (let i = 0; i < numSwitches; i++) {
+		s += `${1 + Math.floor(Math.random() * numPhases)}`
+	}
+	return s
+}
+
+// pick the next request to send
+function nextRequest() {
+	if (Math.random() < options["write-ratio"]) {
+		if (Math.random() < 0.8) {
+			const value = randomSwitches()
+			return { route: "switches", field: "switches", value: value, path: `/api/v1/switches?values=${value}` }
+		}
+		const value = randomPhases()
+		return { route: "phases", field: "phases", value: value, path: `/api/v1/phases?values=${value}` }
+	}
+	const reads = [
+		{ route: "switches/status", field: "switches", path: "/api/v1/switches/status" },
+		{ route: "phases/status", field: "phases", path: "/api/v1/phases/status" },
+		{ route: "zcs/status", field: null, path: "/api/v1/zcs/status" },
+	]
+	return reads[Math.floor(Math.random() * reads.length)]
+}
+
+// send one GET request; resolves to { status, body } or { error }
+function get(path) {
+	return new Promise(resolve => {
+		const req = http.get(options.url + path, { timeout: options.timeout }, res => {
+			var body = ""
+			res.on("data", data => { body += data })
+			res.on("end", () => resolve({ status: res.statusCode, body: body }))
+		})
+		req.on("timeout", () => req.destroy(new Error("timeout")))
+		req.on("error", error => resolve({ error: error.message }))
+	})
+}
+
+// ********************************************** RESULTS ************************************************** //
+
+var stats = {}			// per route: { count, errors, latencies }
+var violations = []		// responses that did not match the model
+var inFlightStarts = new Set()
+
+// record the outcome of one request
+function record(request, start, end, response) {
+	if (stats[request.route] === undefined) {
+		stats[request.route] = { count: 0, errors: 0, latencies: [] }
+	}
+	const s = stats[request.route]
+	s.count++
+	s.latencies.push(end - start)
+
+	var result = null
+	if (response.error === undefined && response.status === 200) {
+		try {
+			result = JSON.parse(response.body)
+		} catch (error) {
+			result = null
+		}
+	}
+	if (result === null || result.status !== "OK") {
+		s.errors++
+	}
+
+	if (request.field === null) {
+		return
+	}
+	if (request.value !== undefined) {
+		// a write: it is a candidate value from when it was sent, and must read back as itself if it succeeded
+		request.write.end = end
+		request.write.ok = (result !== null && result.status === "OK")
+		if (request.write.ok && result[request.field] !== request.value) {
+			violations.push({ route: request.route, expected: request.value, got: result[request.field] })
+		}
+	} else if (result !== null && result.status === "OK" && writes[request.field].length > 0) {
+		const legal = legalValues(request.field, start, end)
+		if (!legal.has(result[request.field])) {
+			violations.push({ route: request.route, expected: [...legal], got: result[request.field] })
+		}
+	}
+}
+
+// the p-th percentile (0-100) of a sorted array
+function percentile(sorted, p) {
+	if (sorted.length === 0) {
+		return 0
+	}
+	return sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * p / 100))]
+}
+
+// print the summary of the run
+function report(elapsedS) {
+	var total = 0, errors = 0
+	console.log(`route                 count   err%    p50ms   p90ms   p99ms   maxms`)
+	for (const route in stats) {
+		const s = stats[route]
+		const sorted = s.latencies.sort((a, b) => a - b)
+		total += s.count
+		errors += s.errors
+		console.log(`${route.padEnd(20)} ${`${s.count}`.padStart(6)} ${(100 * s.errors / s.count).toFixed(1).padStart(6)} ` +
+			`${percentile(sorted, 50).toFixed(1).padStart(8)}${percentile(sorted, 90).toFixed(1).padStart(8)}` +
+			`${percentile(sorted, 99).toFixed(1).padStart(8)}${sorted[sorted.length - 1].toFixed(1).padStart(8)}`)
+	}
+	console.log(`total ${total} requests in ${elapsedS.toFixed(1)} s = ${(total / elapsedS).toFixed(1)} req/s, ` +
+		`${(100 * errors / Math.max(total, 1)).toFixed(1)}% errors, ${violations.length} state model violations`)
+	violations.slice(0, 10).forEach(v => console.log(`violation: ${JSON.stringify(v)}`))
+}
+
+// ********************************************** LEASE CHECK *********************************************** //
+
+// take a short lease, keep the device busy past its expiry with writes of every switch on, queue a group write of
+// every switch on behind them, and let the lease run out without renewing it; the shed must drop the queued group
+// write (and the queued single write), and the bank must end up all off
+async function leaseCheck() {
+	const allOn = "1".repeat(numSwitches)
+	const allOff = "0".repeat(numSwitches)
+	const holder = `load_test_${process.pid}`
+	console.log(`lease check against ${options.url}: lease of ${options["lease-ttl"]} ms`)
+
+	const lease = await get(`/api/v1/lease/renew?holder=${holder}&ttl=${options["lease-ttl"]}`)
+	if (lease.status !== 200) {
+		console.log(`could not take the lease: ${lease.error || lease.body}`)
+		return false
+	}
+	const writes = [get(`/api/v1/switches?values=${allOn}`), get(`/api/v1/switches?values=${allOn}`)]
+	await new Promise(resolve => setTimeout(resolve, options["lease-ttl"] / 4))
+	const group = await get(`/api/v1/group/switches?values=${allOn}`)
+	await Promise.all(writes)
+
+	// wait for the shed to complete
+	var shed = null
+	while (shed === null || shed.completed_at === null) {
+		await new Promise(resolve => setTimeout(resolve, 100))
+		shed = JSON.parse((await get("/api/v1/lease")).body).last_shed
+	}
+	const final = JSON.parse((await get("/api/v1/switches/status")).body)
+
+	const groupCancelled = group.status !== 200 && (group.body || "").includes("cancelled")
+	console.log(`group write: ${group.status} ${(group.body || group.error).trim()}`)
+	console.log(`shed: ${shed.attempts} attempt(s), ${shed.latency_ms} ms after expiry, in flight at expiry: ${shed.in_flight_at_expiry}`)
+	console.log(`switches after the shed: ${final.switches}`)
+	if (!groupCancelled) {
+		console.log("the group write was not dropped by the shed (if it ran before expiry, use a slower board or a shorter lease)")
+	}
+	return groupCancelled && final.switches === allOff
+}
+
+// ********************************************** MAIN ***************************************************** //
+
+// one worker sends requests back to back (or at its share of the paced rate) until the deadline
+async function worker(deadline) {
+	const intervalMs = options.rate > 0 ? 1000 * options.concurrency / options.rate : 0
+	var next = performance.now()
+	while (performance.now() < deadline) {
+		if (intervalMs > 0) {
+			const delay = next - performance.now()
+			if (delay > 0) {
+				await new Promise(resolve => setTimeout(resolve, delay))
+			}
+			next += intervalMs
+		}
+
+		const request = nextRequest()
+		const start = performance.now()
+		if (request.value !== undefined) {
+			request.write = { value: request.value, start: start, end: Infinity, ok: false }
+			writes[request.field].push(request.write)
+		}
+		inFlightStarts.add(start)
+		const response = await get(request.path)
+		inFlightStarts.delete(start)
+		record(request, start, performance.now(), response)
+		pruneWrites(inFlightStarts.size > 0 ? Math.min(...inFlightStarts) : performance.now())
+	}
+}
+
+async function main() {
+	if (options["lease-check"]) {
+		const ok = await leaseCheck()
+		console.log(ok ? "lease check passed" : "lease check FAILED")
+		process.exit(ok ? 0 : 1)
+	}
+
+	console.log(`load test against ${options.url}: concurrency ${options.concurrency}, ` +
+		`rate ${options.rate || "unlimited"}, ${options.duration} s, write ratio ${options["write-ratio"]}`)
+
+	// seed the model with the state the bank starts in
+	for (const field of ["switches", "phases"]) {
+		const start = performance.now()
+		const response = await get(`/api/v1/${field}/status`)
+		const result = JSON.parse(response.body)
+		writes[field].push({ value: result[field], start: start, end: performance.now(), ok: true })
+	}
+
+	const start = performance.now()
+	const deadline = start + options.duration * 1000
+	var workers = []
+	for (let i = 0; i < options.concurrency; i++) {
+		workers.push(worker(deadline))
+	}
+	await Promise.all(workers)
+	report((performance.now() - start) / 1000)
+	process.exit(violations.length > 0 ? 1 : 0)
+}
+
+main()
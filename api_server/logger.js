@@ -0,0 +1,142 @@
+// Structured logging for the API server: one JSON line per record, with a level, kept in memory and
+// written out in batches so that no request waits on the log (or on the SD card behind it).
+// Set LOG_LEVEL (debug, info, warn, error; default info) to choose what is kept, and LOG_FILE to write to a
+// file through an asynchronous stream instead of to stdout (the journal under systemd). stdout is still only
+// written once per flush, rather than once per message.
+// Every HTTP request produces one "request" record with its route, args, status and timing breakdown;
+// LOG_SAMPLE_RATE (0 to 1) keeps only a fraction of those, except that failed and slow requests are always kept.
+// If the writer falls behind by more than maxPendingBytes, records are dropped and the number dropped is logged.
+// Call close() before exiting to write out everything (including what the file stream still has in hand); if the
+// process exits without it, records not yet handed to the stream are still written synchronously.
+
+const fs = require('fs')
+
+// define the levels and which ones are kept
+const levels = { debug: 10, info: 20, warn: 30, error: 40 }
+const minLevel = levels[process.env.LOG_LEVEL] || levels.info
+
+// define the fraction of request records kept, and the time above which a request is always logged
+const sampleRate = parseFloat(process.env.LOG_SAMPLE_RATE || 1)
+const slowMs = parseFloat(process.env.LOG_SLOW_MS || 1000)
+
+// define where records go and how they are batched
+const logFile = process.env.LOG_FILE || null
+const flushIntervalMs = 200
+const flushBytes = 64 * 1024
+const maxPendingBytes = 1024 * 1024
+
+var pending = []		// formatted records waiting to be written
+var pendingBytes = 0
+var writing = 0			// bytes handed to the file stream and not yet written
+var dropped = 0
+var timer = null
+var stream = (logFile !== null) ? fs.createWriteStream(logFile, { flags: 'a' }) : null
+var closed = false
+
+// true if records of level are kept
+function enabled(level) {
+	return levels[level] >= minLevel
+}
+
+// queue a record of level with message msg and any other fields
+function log(level, msg, fields = {}) {
+	if (levels[level] < minLevel) {
+		return
+	}
+	if (pendingBytes + writing > maxPendingBytes) {
+		dropped++
+		return
+	}
+	const line = JSON.stringify(Object.assign({ ts: Date.now(), level: level, msg: msg }, fields)) + "\n"
+	pending.push(line)
+	pendingBytes += line.length
+	if (pendingBytes >= flushBytes) {
+		flush()
+	} else if (timer === null) {
+		timer = setTimeout(flush, flushIntervalMs)
+	}
+}
+
+// write out everything queued so far
+function flush() {
+	if (closed) {
+		flushSync()
+		return
+	}
+	if (timer !== null) {
+		clearTimeout(timer)
+		timer = null
+	}
+	if (dropped > 0) {
+		pending.push(JSON.stringify({ ts: Date.now(), level: "warn", msg: "log records dropped", dropped: dropped }) + "\n")
+		dropped = 0
+	}
+	if (pending.length === 0) {
+		return
+	}
+	const chunk = pending.join("")
+	pending = []
+	pendingBytes = 0
+	if (stream !== null) {
+		writing += chunk.length
+		stream.write(chunk, () => {
+			writing -= chunk.length
+		})
+	} else {
+		process.stdout.write(chunk)
+	}
+}
+
+// write out everything queued so far, synchronously (once the process is exiting, or after close)
+function flushSync() {
+	if (timer !== null) {
+		clearTimeout(timer)
+		timer = null
+	}
+	const chunk = pending.join("")
+	pending = []
+	pendingBytes = 0
+	if (chunk === "") {
+		return
+	}
+	try {
+		if (logFile !== null) {
+			fs.appendFileSync(logFile, chunk)
+		} else {
+			fs.writeSync(1, chunk)
+		}
+	} catch (error) {
+		// nowhere left to report it
+	}
+}
+process.on("exit", flushSync)
+
+// write out everything, wait for the file stream to finish writing and close it; resolves once it is all written
+// (records logged afterwards are written synchronously)
+function close() {
+	flush()
+	closed = true
+	if (stream === null) {
+		return Promise.resolve()
+	}
+	return new Promise(resolve => stream.end(resolve))
+}
+
+// record one HTTP request (sampled, except for failures and slow requests)
+function request(fields) {
+	if (fields.status < 500 && fields.ms < slowMs && Math.random() >= sampleRate) {
+		return
+	}
+	log(fields.status >= 500 ? "warn" : "info", "request", fields)
+}
+
+module.exports = {
+	enabled,
+	debug: (msg, fields) => log("debug", msg, fields),
+	info: (msg, fields) => log("info", msg, fields),
+	warn: (msg, fields) => log("warn", msg, fields),
+	error: (msg, fields) => log("error", msg, fields),
+	request,
+	flush,
+	close,
+}
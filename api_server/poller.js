@@ -0,0 +1,96 @@
+// Background poller that keeps the device state snapshot fresh so that changes made behind
+// the API's back (load_bank_cli_serial, the Netburner CLI) are noticed without a page reload.
+// It polls quickly while the state is changing and for a short window after each write, and backs
+// off while nothing changes (including while an out-of-band change leaves the state drifted from
+// what was commanded, which may last indefinitely), and it only submits a query when no user
+// command is waiting so that it never delays one.
+
+const deviceQueue = require('./device_queue')
+const deviceState = require('./device_state')
+
+// define the fastest and slowest polling intervals in milliseconds
+const minIntervalMs = parseInt(process.env.POLL_MIN_INTERVAL_MS || 250)
+const maxIntervalMs = parseInt(process.env.POLL_MAX_INTERVAL_MS || 10000)
+
+// define how long to keep polling at the fastest interval after a write
+const fastWindowMs = parseInt(process.env.POLL_FAST_WINDOW_MS || 5000)
+
+// the queries making up one poll
+const pollQueries = [["SW?"], ["PHASE?"], ["ZCS?"]]
+
+var intervalMs = minIntervalMs
+var timer = null
+var polling = false
+var lastPoll = null
+var fastUntil = 0		// time until which to poll at the fastest interval
+
+// start polling
+function start() {
+	schedule(0)
+}
+
+// poll again soon (called after writes, which are likely to be followed by more changes)
+function kick() {
+	intervalMs = minIntervalMs
+	fastUntil = Date.now() + fastWindowMs
+	schedule(intervalMs)
+}
+
+// (re)arm the poll timer to fire in delayMs
+function schedule(delayMs) {
+	if (timer !== null) {
+		clearTimeout(timer)
+	}
+	timer = setTimeout(poll, delayMs)
+}
+
+// run one poll, one query at a time, giving way to any user command that shows up in between
+async function poll() {
+	timer = null
+	if (polling) {
+		return
+	}
+	polling = true
+
+	var changed = false
+	for (const args of pollQueries) {
+		// let user commands drain before each query; they will have refreshed the state anyway
+		while (deviceQueue.userBusy()) {
+			await new Promise(resolve => setTimeout(resolve, minIntervalMs))
+		}
+		var result = await deviceQueue.submit(args, deviceQueue.PRIORITY_BACKGROUND)
+		if (deviceState.record(args, result.stdout)) {
+			changed = true
+		}
+	}
+	lastPoll = Date.now()
+	polling = false
+
+	// poll quickly while things are changing or just after a write, otherwise back off exponentially
+	if (changed || Date.now() < fastUntil) {
+		intervalMs = minIntervalMs
+	} else {
+		intervalMs = Math.min(intervalMs * 2, maxIntervalMs)
+	}
+	if (timer === null) {
+		schedule(intervalMs)
+	}
+}
+
+// summary of the poller and the state it is tracking, for the status endpoint
+function status() {
+	return {
+		status: "OK",
+		snapshot: deviceState.snapshot,
+		commanded: deviceState.commanded,
+		drift: deviceState.drift(),
+		interval_ms: intervalMs,
+		last_poll: lastPoll,
+	}
+}
+
+module.exports = {
+	start,
+	kick,
+	status,
+}
@@ -0,0 +1,107 @@
+// Keeps the last state reported by the board in a small file so that a restarted API server can
+// answer status requests straight away instead of waiting for three serial round trips.
+// The file has a fixed layout and each change only rewrites the slot of the field that changed
+// (and the header) in place, so saving costs one small write into the page cache:
+//	0	"LBSNAP1\n"
+//	8	generation (float64)
+//	16	time of the last save in ms (float64)
+//	32	switches, 64	phases, ... one SLOT_SIZE slot per field: length byte then the value
+// On startup the saved state is restored into the device state marked unverified; the poller's
+// first poll (which runs straight away) then confirms or corrects it against the board.
+
+const fs = require('fs')
+const path = require('path')
+const deviceState = require('./device_state')
+const logger = require('./logger')
+
+// define where the snapshot is kept
+const snapshotFile = process.env.STATE_SNAPSHOT_FILE || path.join(__dirname, "state_snapshot.bin")
+
+// file layout
+const MAGIC = "LBSNAP1\n"
+const HEADER_SIZE = 32
+const SLOT_SIZE = 160		// holds the switch or phase string of a 128 switch bank
+const fields = ["switches", "phases", "zcs"]
+const FILE_SIZE = HEADER_SIZE + fields.length * SLOT_SIZE
+
+// characters each field may contain (anything else means the slot was never written or is damaged)
+const validValue = { switches: /^[01]+$/, phases: /^[1-9?]+$/, zcs: /^[01]$/ }
+
+var fd = null
+
+// read the saved snapshot; returns { generation, savedAt, state } or null if there is no usable file
+function load() {
+	const buf = Buffer.alloc(FILE_SIZE)
+	try {
+		const readFd = fs.openSync(snapshotFile, "r")
+		fs.readSync(readFd, buf, 0, FILE_SIZE, 0)
+		fs.closeSync(readFd)
+	} catch (error) {
+		return null
+	}
+	if (buf.toString("latin1", 0, MAGIC.length) !== MAGIC) {
+		return null
+	}
+	var state = {}
+	fields.forEach((field, i) => {
+		const offset = HEADER_SIZE + i * SLOT_SIZE
+		const len = buf[offset]
+		const value = buf.toString("latin1", offset + 1, offset + 1 + Math.min(len, SLOT_SIZE - 1))
+		state[field] = (len > 0 && validValue[field].test(value)) ? value : null
+	})
+	return { generation: buf.readDoubleLE(8), savedAt: buf.readDoubleLE(16), state: state }
+}
+
+// rewrite the header with the current generation
+function writeHeader() {
+	const header = Buffer.alloc(HEADER_SIZE)
+	header.write(MAGIC, 0, "latin1")
+	header.writeDoubleLE(deviceState.getGeneration(), 8)
+	header.writeDoubleLE(Date.now(), 16)
+	fs.writeSync(fd, header, 0, HEADER_SIZE, 0)
+}
+
+// rewrite the slot of one field
+function writeSlot(field, value) {
+	const slot = Buffer.alloc(SLOT_SIZE)
+	const len = (value === null) ? 0 : slot.write(`${value}`, 1, SLOT_SIZE - 1, "latin1")
+	slot[0] = len
+	fs.writeSync(fd, slot, 0, SLOT_SIZE, HEADER_SIZE + fields.indexOf(field) * SLOT_SIZE)
+}
+
+// called by the device state tracker on every change to the reported state
+function onStateChange(field, oldValue, newValue) {
+	if (fd === null || !fields.includes(field)) {
+		return
+	}
+	try {
+		writeSlot(field, newValue)
+		writeHeader()
+	} catch (error) {
+		logger.error("could not save state snapshot", { error: error.message })
+	}
+}
+
+// restore the saved snapshot (unverified) and keep the file up to date from now on
+// (the other state listeners only hear of the restored fields once the board confirms them, see deviceState.restore)
+function start() {
+	const saved = load()
+	if (saved !== null) {
+		deviceState.restore(saved.state, saved.generation)
+		logger.info("restored state snapshot (unverified)", { generation: saved.generation, saved_at: new Date(saved.savedAt).toISOString() })
+	}
+	try {
+		fd = fs.openSync(snapshotFile, fs.existsSync(snapshotFile) ? "r+" : "w+")
+		fs.ftruncateSync(fd, FILE_SIZE)
+		fields.forEach(field => writeSlot(field, deviceState.snapshot[field]))
+		writeHeader()
+	} catch (error) {
+		logger.error("could not open state snapshot file", { error: error.message })
+		fd = null
+	}
+	deviceState.onChange(onStateChange)
+}
+
+module.exports = {
+	start,
+}
@@ -0,0 +1,63 @@
+// Optional per-request span tracing in Chrome/Perfetto JSON format.
+// Set TRACE_FILE to enable it and TRACE_SAMPLE_RATE (0 to 1) to trace only a fraction of requests.
+// Spans from the serial interface are appended to the same file by the child process, which is
+// handed the trace id and file through LOAD_BANK_TRACE_ID and LOAD_BANK_TRACE_FILE.
+// Every span of a request is recorded with tid = trace id so that each request gets its own track.
+
+const fs = require('fs')
+const { performance } = require('perf_hooks')
+
+// define where traces go and which fraction of requests get traced
+const traceFile = process.env.TRACE_FILE || null
+const sampleRate = parseFloat(process.env.TRACE_SAMPLE_RATE || 1)
+
+// the trace file is opened on first use and written in append mode so that the serial
+// interface processes can append their own events to it
+var stream = null
+var nextTraceId = 1
+
+// current time in microseconds since the epoch (the same clock the serial interface uses)
+function nowUs() {
+	return Math.round((performance.timeOrigin + performance.now()) * 1000)
+}
+
+// start tracing a request; returns null if tracing is off or the request was not sampled
+function startTrace() {
+	if (traceFile === null || Math.random() >= sampleRate) {
+		return null
+	}
+	if (stream === null) {
+		// the JSON array format allows the closing bracket to be missing, so the file stays valid
+		// while it is being appended to
+		if (!fs.existsSync(traceFile) || fs.statSync(traceFile).size === 0) {
+			fs.writeFileSync(traceFile, "[\n")
+		}
+		stream = fs.createWriteStream(traceFile, { flags: 'a' })
+	}
+	return { id: nextTraceId++, start: nowUs() }
+}
+
+// record a complete span from startUs to endUs for trace
+function span(trace, name, startUs, endUs, args = {}) {
+	if (trace === null) {
+		return
+	}
+	args.trace_id = trace.id
+	const event = { name: name, cat: "api", ph: "X", ts: startUs, dur: endUs - startUs, pid: 1, tid: trace.id, args: args }
+	stream.write(JSON.stringify(event) + ",\n")
+}
+
+// environment for a serial interface process run on behalf of trace
+function childEnv(trace) {
+	if (trace === null) {
+		return process.env
+	}
+	return Object.assign({}, process.env, { LOAD_BANK_TRACE_FILE: traceFile, LOAD_BANK_TRACE_ID: `${trace.id}` })
+}
+
+module.exports = {
+	nowUs,
+	startTrace,
+	span,
+	childEnv,
+}
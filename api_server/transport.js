@@ -0,0 +1,93 @@
+// Multipath access to the board: the FTDI serial link and the Netburner ethernet path reach
+// the same hardware. Each configured path is health-checked in the background and commands go
+// over the fastest healthy one; when a command finds its path down, the path is marked unhealthy
+// and the next path takes over straight away.
+// A command is only retried on another path when the serial interface reports that nothing was
+// sent (exit status 3), or when it was a query (safe to repeat); a write that went out but was
+// not answered (exit status 4) is never sent again, since the board may already have applied it.
+
+// define the paths to the board, in order of preference ("serial" or "tcp:<host>:<port>")
+const paths = (process.env.LOAD_BANK_TRANSPORTS || "serial").split(",").map(name => ({
+	name: name,
+	healthy: true,
+	latency_us: null,
+	failures: 0,
+	last_check: null,
+	last_error: null,
+}))
+
+// define how often paths are health-checked
+const healthIntervalMs = parseInt(process.env.TRANSPORT_HEALTH_INTERVAL_MS || 5000)
+
+// exit statuses of the serial interface (see load_bank_interface.c)
+const EXIT_NOT_SENT = 3
+const EXIT_NO_RESPONSE = 4
+
+// the path commands should use now: the fastest healthy path, or the first one if none are healthy
+function active() {
+	var best = null
+	for (const path of paths) {
+		if (path.healthy && (best === null || (path.latency_us !== null && (best.latency_us === null || path.latency_us < best.latency_us)))) {
+			best = path
+		}
+	}
+	return best !== null ? best : paths[0]
+}
+
+// environment selecting a path for the serial interface
+function env(path) {
+	return { LOAD_BANK_TRANSPORT: path.name }
+}
+
+// record the outcome of a command run over path; returns true if it may be retried on another path
+function report(path, code, isWrite) {
+	if (code === EXIT_NOT_SENT || code === EXIT_NO_RESPONSE) {
+		path.healthy = false
+		path.failures++
+		path.last_error = (code === EXIT_NOT_SENT) ? "unreachable" : "no response"
+		return paths.some(p => p !== path && p.healthy) && (code === EXIT_NOT_SENT || !isWrite)
+	}
+	if (code === 0) {
+		path.healthy = true
+	}
+	return false
+}
+
+// check every path by timing a few status queries over it
+async function healthCheck(deviceQueue) {
+	for (const path of paths) {
+		const result = await deviceQueue.submit(["LATENCY", "3"], deviceQueue.PRIORITY_BACKGROUND, null, null, path)
+		path.last_check = Date.now()
+		try {
+			const latency = JSON.parse(result.stdout)
+			path.healthy = (latency.status === "OK")
+			path.latency_us = path.healthy ? latency.rtt_us.p50 : null
+			path.last_error = path.healthy ? null : latency.msg
+		} catch (error) {
+			path.healthy = false
+			path.latency_us = null
+			path.last_error = result.error !== null ? result.error.message : `exit status ${result.code}`
+		}
+	}
+}
+
+// start health-checking (only needed when there is more than one path to choose from)
+function start(deviceQueue) {
+	if (paths.length > 1) {
+		healthCheck(deviceQueue)
+		setInterval(() => healthCheck(deviceQueue), healthIntervalMs).unref()
+	}
+}
+
+// path state for the API
+function status() {
+	return { status: "OK", active: active().name, paths: paths }
+}
+
+module.exports = {
+	active,
+	env,
+	report,
+	start,
+	status,
+}
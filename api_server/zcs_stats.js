@@ -0,0 +1,199 @@
+// Zero-crossing wait statistics. The board holds every switch write until the next zero crossing of the
+// mains, so a switch round trip minus a plain query round trip is how long it waited. The serial interface
+// reports both round trips, and the time of each OK, with every switch result (zcs_timing); this keeps a
+// rolling window of the waits and estimates the mains frequency from them in two ways:
+//	crossing alignment: the OKs all land on a lattice of half periods, so the frequency is the one at which
+//		their times line up best (searched between minHz and maxHz)
+//	wait range: waits are spread evenly over one half period, so their top end is the half period
+// A wait well beyond one half period means the board missed a crossing it should have switched on; these are
+// flagged (and logged) as early warning, long before the board gives up with ERR ZCS TMOUT after 10 s.
+
+const logger = require('./logger')
+
+// define the size of the rolling window and how far back the alignment estimate looks
+const windowSize = parseInt(process.env.ZCS_STATS_WINDOW || 512)
+const alignWindowMs = parseInt(process.env.ZCS_ALIGN_WINDOW_MS || 30000)
+const maxAlignSamples = 128
+
+// define the range searched for the mains frequency, and the frequency assumed until there is an estimate
+const minHz = 45
+const maxHz = 65
+const nominalHz = parseFloat(process.env.NOMINAL_MAINS_HZ || 60)
+
+// a wait longer than this many half periods is abnormal
+const abnormalFactor = parseFloat(process.env.ZCS_ABNORMAL_FACTOR || 1.5)
+
+// alignment (0 to 1) needed before the crossing alignment estimate is trusted
+const minAlignment = 0.7
+
+var samples = []		// { wait_us, replied_us, at } of the most recent switch writes, oldest first
+var queryRtts = []		// most recent query round trips, the baseline subtracted from switch round trips
+var recentAbnormal = []		// the most recent abnormal waits
+var abnormalCount = 0
+var timeouts = 0
+var estimate = null		// cached frequency estimate, cleared by every new sample
+var mainsHz = nominalHz		// latest frequency estimate, kept while the next one is waiting to be worked out
+
+// median of a list of numbers
+function median(values) {
+	const sorted = values.slice().sort((a, b) => a - b)
+	return sorted[Math.floor(sorted.length / 2)]
+}
+
+// take the zcs_timing of a switch result from the serial interface (anything else is ignored)
+function record(args, stdout) {
+	if (!args[0].startsWith("SW") || args[0] === "SW?") {
+		return
+	}
+	var result
+	try {
+		result = JSON.parse(stdout)
+	} catch (error) {
+		return
+	}
+	if (result.status === "Request Timeout") {
+		timeouts++
+		logger.warn("no zero crossing seen", { args: args.join(" ") })
+		return
+	}
+	const timing = result.zcs_timing
+	if (result.status !== "OK" || timing === undefined) {
+		return
+	}
+
+	if (timing.query_rtt_us >= 0) {
+		queryRtts.push(timing.query_rtt_us)
+		if (queryRtts.length > 64) {
+			queryRtts.shift()
+		}
+	}
+	const baseline = (queryRtts.length > 0) ? median(queryRtts) : 0
+	const threshold = abnormalThresholdUs()
+	for (let i = 0; i < timing.sw_rtt_us.length; i++) {
+		const sample = { wait_us: Math.max(0, timing.sw_rtt_us[i] - baseline), replied_us: timing.sw_replied_us[i], at: Date.now() }
+		samples.push(sample)
+		if (sample.wait_us > threshold) {
+			abnormalCount++
+			recentAbnormal.push({ at: sample.at, wait_us: sample.wait_us, threshold_us: threshold, args: args.join(" ") })
+			if (recentAbnormal.length > 20) {
+				recentAbnormal.shift()
+			}
+			logger.warn("abnormal zero crossing wait", { wait_us: sample.wait_us, threshold_us: threshold, args: args.join(" ") })
+		}
+	}
+	if (samples.length > windowSize) {
+		samples.splice(0, samples.length - windowSize)
+	}
+	estimate = null
+}
+
+// how well the times (in seconds) line up on a lattice of half periods at hz: the length of the mean of their phasors
+function alignment(times, hz) {
+	var re = 0
+	var im = 0
+	for (const t of times) {
+		const phase = 2 * Math.PI * 2 * hz * t
+		re += Math.cos(phase)
+		im += Math.sin(phase)
+	}
+	return Math.hypot(re, im) / times.length
+}
+
+// frequency at which the recent OK times line up best: a grid fine enough not to step over the peak
+// (the phase across the whole span moves by at most an eighth of a turn per step), then a finer one around the best
+function alignFrequency() {
+	const cutoff = Date.now() - alignWindowMs
+	const recent = samples.filter(sample => sample.at >= cutoff).slice(-maxAlignSamples)
+	if (recent.length < 8) {
+		return null
+	}
+	const t0 = recent[0].replied_us
+	const times = recent.map(sample => (sample.replied_us - t0) / 1e6)
+	const span = Math.max(...times) - Math.min(...times)
+	if (span <= 0) {
+		return null
+	}
+
+	var step = Math.min(0.1, 1 / (16 * span))
+	var best = { hz: null, alignment: 0 }
+	for (let hz = minHz; hz <= maxHz; hz += step) {
+		const a = alignment(times, hz)
+		if (a > best.alignment) {
+			best = { hz: hz, alignment: a }
+		}
+	}
+	for (let hz = best.hz - step; hz <= best.hz + step; hz += step / 20) {
+		const a = alignment(times, hz)
+		if (a > best.alignment) {
+			best = { hz: hz, alignment: a }
+		}
+	}
+	return best
+}
+
+// current frequency estimate: { hz, method, alignment }
+function frequency() {
+	if (estimate !== null) {
+		return estimate
+	}
+	estimate = { hz: null, method: null, alignment: null }
+	const aligned = alignFrequency()
+	if (aligned !== null) {
+		estimate.alignment = +aligned.alignment.toFixed(3)
+		if (aligned.alignment >= minAlignment) {
+			estimate.hz = aligned.hz
+			estimate.method = "crossing alignment"
+		}
+	}
+	if (estimate.hz === null && samples.length >= 20) {
+		// waits are spread evenly over [0, half period); the 95th percentile is 0.95 of the way up
+		const waits = samples.map(sample => sample.wait_us).sort((a, b) => a - b)
+		const halfPeriodUs = waits[Math.floor(0.95 * (waits.length - 1))] / 0.95
+		const hz = 1e6 / (2 * halfPeriodUs)
+		if (hz >= minHz && hz <= maxHz) {
+			estimate.hz = hz
+			estimate.method = "wait range"
+		}
+	}
+	if (estimate.hz !== null) {
+		mainsHz = estimate.hz
+	}
+	return estimate
+}
+
+// waits longer than this are abnormal (at the latest frequency estimate, or the nominal frequency until there is one)
+function abnormalThresholdUs() {
+	return Math.round(abnormalFactor * 1e6 / (2 * mainsHz))
+}
+
+// report the statistics
+function status() {
+	const f = frequency()
+	const waits = samples.map(sample => sample.wait_us).sort((a, b) => a - b)
+	const percentile = p => waits[Math.min(waits.length - 1, Math.floor(p * waits.length))]
+	return {
+		status: "OK",
+		samples: waits.length,
+		baseline_query_rtt_us: (queryRtts.length > 0) ? median(queryRtts) : null,
+		wait_us: (waits.length === 0) ? null : {
+			min: waits[0],
+			mean: Math.round(waits.reduce((total, wait) => total + wait, 0) / waits.length),
+			p50: percentile(0.5),
+			p90: percentile(0.9),
+			p99: percentile(0.99),
+			max: waits[waits.length - 1],
+		},
+		mains_hz: (f.hz !== null) ? +f.hz.toFixed(3) : null,
+		mains_hz_method: f.method,
+		alignment: f.alignment,
+		abnormal_threshold_us: abnormalThresholdUs(),
+		abnormal: abnormalCount,
+		timeouts: timeouts,
+		recent_abnormal: recentAbnormal,
+	}
+}
+
+module.exports = {
+	record,
+	status,
+}
@@ -2,11 +2,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <arpa/inet.h>   //for inet_addr, bind, listen, accept, socket types
-#include <netinet/in.h>  //for structures relating to IPv4 addresses
 
-#define NETBURNER_ADDR "192.168.68.117"
-#define NETBURNER_PORT 23
+#include "load_bank_io.h"
+
+#define NETBURNER_ADDR "tcp:192.168.68.117:23"
+#define RESPONSE_TIMEOUT_MS 12000	// longer than the 10 s zero-crossing timeout of the board
 
 uint32_t buf_to_mask (char *buf)
 {
@@ -42,20 +42,23 @@ uint32_t binstring_to_mask (char *buf) {
 	return mask;
 }
 
-void wait_for_response (int sockfd)
+lbio_request_t request;		// the message on the wire (one at a time)
+
+void wait_for_response (lbio_conn_t *board)
 {
 	char msg[32];
-	uint8_t len;
-
-	// Read the message length
-	read(sockfd, &len, 1);
 
-	// Read the payload of message
-	int i;
-	for (i = 0; i < len; i++) {
-		read(sockfd, msg + i, 1);
+	// Wait for the reply to the message written by write_msg
+	if (lbio_wait(board, &request) != LBIO_OK) {
+		printf("No response from the board\n");
+		return;
+	}
+	size_t len = request.reply_len;
+	if (len > sizeof(msg) - 1) {
+		len = sizeof(msg) - 1;
 	}
-	msg[i] = '\0';
+	memcpy(msg, request.reply, len);
+	msg[len] = '\0';
 
 	// Print out the message
 	if (strncmp(msg, "SW", 2) == 0) {
@@ -82,16 +85,12 @@ void wait_for_response (int sockfd)
 	}
 }
 
-void write_msg (int sockfd, char *msg, uint8_t len)
+void write_msg (lbio_conn_t *board, char *msg, uint8_t len)
 {
-	char *buf = (char *) malloc(len + 2);
-	buf[0] = (char) len;
-	memcpy(buf + 1, msg, len); // copy message over
-	write(sockfd, buf, len + 1); // send the buffer
-	free(buf);
+	lbio_submit(board, &request, msg, len, RESPONSE_TIMEOUT_MS, NULL, NULL);
 }
 
-void prompt_zcs_msg (int sockfd)
+void prompt_zcs_msg (lbio_conn_t *board)
 {
 	char *buf = NULL;
 	size_t len = 0;;
@@ -100,19 +99,19 @@ void prompt_zcs_msg (int sockfd)
 	getline(&buf, &len, stdin);
 
 	if (strncmp(buf, "ON", 2) == 0) {
-		write_msg(sockfd, "ZCS ON\n", 7);
+		write_msg(board, "ZCS ON\n", 7);
 	} else if (strncmp(buf, "OFF", 3) == 0) {
-		write_msg(sockfd, "ZCS OFF\n", 8);
+		write_msg(board, "ZCS OFF\n", 8);
 	} else {
 		printf("Did not specify one of ON or OFF, aborting\n");
 		free(buf);
 		return;
 	}
-	wait_for_response(sockfd);
+	wait_for_response(board);
 	free(buf);
 }
 
-void prompt_sw_msg (int sockfd)
+void prompt_sw_msg (lbio_conn_t *board)
 {
 	char *buf = NULL;
 	size_t len = 0;
@@ -131,13 +130,13 @@ void prompt_sw_msg (int sockfd)
 	mask_to_buf(msg + 3, desired_state);
 	msg[7] = '\n';
 	msg[8] = '\0';
-	write_msg(sockfd, msg, 8);
+	write_msg(board, msg, 8);
 
-	wait_for_response(sockfd);
+	wait_for_response(board);
 	free(buf);
 }
 
-void prompt_phase_msg (int sockfd)
+void prompt_phase_msg (lbio_conn_t *board)
 {
 	char *buf = NULL;
 	size_t len = 0;
@@ -161,44 +160,40 @@ void prompt_phase_msg (int sockfd)
 	mask_to_buf(msg + 14, phase_defs[2]);
 	msg[18] = '\n';
 	msg[19] = '\0';
-	write_msg(sockfd, msg, 19);
+	write_msg(board, msg, 19);
 
-	wait_for_response(sockfd);
+	wait_for_response(board);
 	free(buf);
 }
 
-void send_zcs_query_msg (int sockfd)
+void send_zcs_query_msg (lbio_conn_t *board)
 {
-	write_msg(sockfd, "ZCS?\n", 5);
-	wait_for_response(sockfd);
+	write_msg(board, "ZCS?\n", 5);
+	wait_for_response(board);
 }
 
-void send_sw_query_msg (int sockfd)
+void send_sw_query_msg (lbio_conn_t *board)
 {
-	write_msg(sockfd, "SW?\n", 4);
-	wait_for_response(sockfd);
+	write_msg(board, "SW?\n", 4);
+	wait_for_response(board);
 }
 
-void send_phase_query_msg (int sockfd)
+void send_phase_query_msg (lbio_conn_t *board)
 {
-	write_msg(sockfd, "PHASE?\n", 7);
-	wait_for_response(sockfd);
+	write_msg(board, "PHASE?\n", 7);
+	wait_for_response(board);
 }
 
 
 int main()
 {
-	// Make a socket
-	int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-
-	// Fill out server address
-	struct sockaddr_in server_addr;
-	server_addr.sin_family = AF_INET;
-	server_addr.sin_port = htons(NETBURNER_PORT);
-	server_addr.sin_addr.s_addr = inet_addr(NETBURNER_ADDR);
-
-	// Connect the socket
-	connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr));
+	// Connect to the netburner
+	lbio_conn_t board_conn;
+	lbio_conn_t *board = &board_conn;
+	if (lbio_open(board, NETBURNER_ADDR) == -1) {
+		printf("unable to connect to the netburner\n");
+		return 1;
+	}
 
 	char *buf = (char *) malloc(32);
 	size_t len = 0;
@@ -206,17 +201,17 @@ int main()
 		printf("What message to send? SW, ZCS, PHASE, SW?, ZCS?, PHASE? ... EXIT to exit CLI.\n> ");
 		getline(&buf, &len, stdin);
 		if (strncmp(buf, "ZCS?", 4) == 0) {
-			send_zcs_query_msg(sockfd);
+			send_zcs_query_msg(board);
 		} else if (strncmp(buf, "ZCS", 3) == 0) {
-			prompt_zcs_msg(sockfd);
+			prompt_zcs_msg(board);
 		} else if (strncmp(buf, "SW?", 3) == 0) {
-			send_sw_query_msg(sockfd);
+			send_sw_query_msg(board);
 		} else if (strncmp(buf, "SW", 2) == 0) {
-			prompt_sw_msg(sockfd);
+			prompt_sw_msg(board);
 		} else if (strncmp(buf, "PHASE?", 6) == 0) {
-			send_phase_query_msg(sockfd);
+			send_phase_query_msg(board);
 		} else if (strncmp(buf, "PHASE", 5) == 0) {
-			prompt_phase_msg(sockfd);
+			prompt_phase_msg(board);
 		} else if (strncmp(buf, "EXIT", 4) == 0) {
 			break;
 		} else {
@@ -225,7 +220,7 @@ int main()
 	}
 
 	// Close the socket
-	close(sockfd);
+	lbio_close(board);
 	free(buf);
 
 	return 0;
@@ -1,29 +1,29 @@
-
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <arpa/inet.h>   //for inet_addr, bind, listen, accept, socket types
-#include <netinet/in.h>  //for structures relating to IPv4 addresses
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "load_bank_io.h"
 
-#define NETBURNER_ADDR "192.168.68.107"
-#define NETBURNER_PORT 23
+// this client speaks the unframed line protocol ("SW xxxx\n" out, one line back) rather than the length prefixed one
+// of the other tools, so only the connection comes from load_bank_io, and the exchange itself is done here
+#define NETBURNER_ADDR "tcp:192.168.68.107:23"
+#define RESPONSE_TIMEOUT_MS 12000	// longer than the 10 s zero-crossing timeout of the board
 
 int main()
 {
-	// Make a socket
-	int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-
-	// Fill out server address
-	struct sockaddr_in server_addr;
-	server_addr.sin_family = AF_INET;
-	server_addr.sin_port = htons(NETBURNER_PORT);
-	server_addr.sin_addr.s_addr = inet_addr(NETBURNER_ADDR);
-
-	// Connect the socket
-	connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr));
+	// Connect to the netburner
+	lbio_conn_t board;
+	if (lbio_open(&board, NETBURNER_ADDR) == -1) {
+		printf("unable to connect to the netburner\n");
+		return 1;
+	}
+	int sockfd = lbio_fd(&board);
 
-	// Write something to the board
+	// Write something to the board (the socket is non-blocking, but an empty socket buffer always takes 8 bytes)
 	char msg[16];
 	uint32_t state = 0b010101010101010101;
 	char first_byte = (char)((state >> 24) & 0b11111111);
@@ -31,13 +31,33 @@ int main()
 	char third_byte = (char)((state >> 8) & 0b11111111);
 	char fourth_byte = (char)(state & 0b11111111);
 	sprintf(msg, "SW %c%c%c%c\n", first_byte, second_byte, third_byte, fourth_byte);
-	write(sockfd, msg, 8);
+	if (write(sockfd, msg, 8) != 8) {
+		printf("unable to write to the netburner\n");
+		lbio_close(&board);
+		return 1;
+	}
 
-	// Read the message back
-	int i = 0;
-	do {
-		read(sockfd, msg + i, 1);
-	} while (msg[i++] != '\n');
+	// Read the message back, up to the newline, giving up after RESPONSE_TIMEOUT_MS
+	long long deadline_us = lbio_now_us() + RESPONSE_TIMEOUT_MS * 1000LL;
+	size_t i = 0;
+	while (i < sizeof(msg) - 1) {
+		struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+		int wait_ms = (deadline_us - lbio_now_us()) / 1000;
+		if (wait_ms <= 0 || (poll(&pfd, 1, wait_ms) == 0)) {
+			printf("no response from the netburner within %d ms\n", RESPONSE_TIMEOUT_MS);
+			lbio_close(&board);
+			return 1;
+		}
+		int n = read(sockfd, msg + i, 1);
+		if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+			printf("connection to the netburner closed\n");
+			lbio_close(&board);
+			return 1;
+		}
+		if (n == 1 && msg[i++] == '\n') {
+			break;
+		}
+	}
 	msg[i] = '\0';
 
 	// Print out the message
@@ -45,7 +65,7 @@ int main()
 
 
 	// Close the socket
-	close(sockfd);
+	lbio_close(&board);
 
 	return 0;
 }
@@ -0,0 +1,105 @@
+#ifndef LOAD_BANK_GEOMETRY_H
+#define LOAD_BANK_GEOMETRY_H
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+// Geometry of the load bank, fixed at compile time. The defaults describe the current 18 switch, 3 phase bank;
+// wider banks are built with eg. gcc -DNUM_SWITCHES=40 ... (the board firmware has to be built for the same geometry).
+// On the wire every switch mask is sent big-endian in MASK_BYTES bytes, bit i for switch i + 1: once in SW messages
+// and once per phase in PHASE messages. MASK_BYTES is the smallest of 4, 8 and 16 that holds every switch, so banks of
+// up to 32 switches keep the 4 byte masks (and the 8 and 19 byte SW and PHASE messages) they have always used.
+// Each mask width has its own mask_t and its own conversions below.
+
+#ifndef NUM_SWITCHES
+#define NUM_SWITCHES 18
+#endif
+#ifndef NUM_PHASES
+#define NUM_PHASES 3
+#endif
+
+#if NUM_SWITCHES < 1 || NUM_SWITCHES > 128
+#error "NUM_SWITCHES must be between 1 and 128"
+#elif NUM_SWITCHES <= 32
+typedef uint32_t mask_t;
+#define MASK_BYTES 4
+#elif NUM_SWITCHES <= 64
+typedef uint64_t mask_t;
+#define MASK_BYTES 8
+#else
+typedef unsigned __int128 mask_t;
+#define MASK_BYTES 16
+#endif
+
+// phases are written as the digits 1 to NUM_PHASES in phase strings
+#if NUM_PHASES < 1 || NUM_PHASES > 9
+#error "NUM_PHASES must be between 1 and 9"
+#endif
+
+#define MASK_BIT(i) (((mask_t) 1) << (i))
+#define ALL_SWITCHES ((NUM_SWITCHES == MASK_BYTES * 8) ? ~(mask_t) 0 : MASK_BIT(NUM_SWITCHES % (MASK_BYTES * 8)) - 1)
+
+// message lengths, not counting the length byte
+#define SW_MSG_LEN (3 + MASK_BYTES + 1)				// "SW " mask "\n"
+#define PHASE_MSG_LEN (6 + (NUM_PHASES * MASK_BYTES) + 1)	// "PHASE " one mask per phase "\n"
+
+// big enough for any message of this geometry, and for a switch or phase string, with a terminating nul
+#define GEOMETRY_BUFSIZE (((PHASE_MSG_LEN > NUM_SWITCHES) ? PHASE_MSG_LEN : NUM_SWITCHES) + 1)
+
+// convert from MASK_BYTES-char buffer to bitmask
+static inline mask_t buf_to_mask (char *buf)
+{
+#if MASK_BYTES == 4
+	return (((uint32_t)(uint8_t)buf[0]) << 24) | (((uint32_t)(uint8_t)buf[1]) << 16) | (((uint32_t)(uint8_t)buf[2]) << 8) | (uint32_t)(uint8_t)buf[3];
+#elif MASK_BYTES == 8
+	uint64_t mask;
+	memcpy(&mask, buf, 8);
+	return be64toh(mask);
+#else
+	uint64_t high, low;
+	memcpy(&high, buf, 8);
+	memcpy(&low, buf + 8, 8);
+	return (((mask_t) be64toh(high)) << 64) | be64toh(low);
+#endif
+}
+
+// convert from bitmask to MASK_BYTES-char buffer
+static inline void mask_to_buf (char *buf, mask_t mask)
+{
+#if MASK_BYTES == 4
+	buf[0] = (char)((mask >> 24) & 0b11111111);
+	buf[1] = (char)((mask >> 16) & 0b11111111);
+	buf[2] = (char)((mask >> 8) & 0b11111111);
+	buf[3] = (char)(mask & 0b11111111);
+#elif MASK_BYTES == 8
+	uint64_t be = htobe64(mask);
+	memcpy(buf, &be, 8);
+#else
+	uint64_t high = htobe64((uint64_t)(mask >> 64)), low = htobe64((uint64_t) mask);
+	memcpy(buf, &high, 8);
+	memcpy(buf + 8, &low, 8);
+#endif
+}
+
+// number of switches set in a mask
+static inline int mask_count (mask_t mask)
+{
+#if MASK_BYTES == 4
+	return __builtin_popcount(mask);
+#elif MASK_BYTES == 8
+	return __builtin_popcountll(mask);
+#else
+	return __builtin_popcountll((uint64_t)(mask >> 64)) + __builtin_popcountll((uint64_t) mask);
+#endif
+}
+
+// write the NUM_SWITCHES characters of a mask as 1s and 0s (first switch first), without a terminator
+static inline void mask_to_chars (mask_t mask, char *chars)
+{
+	for (int i = 0; i < NUM_SWITCHES; i++, mask >>= 1) {
+		chars[i] = '0' + (char)(mask & 1);
+	}
+}
+
+#endif
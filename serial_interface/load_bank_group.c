@@ -0,0 +1,242 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "load_bank_io.h"
+#include "load_bank_geometry.h"
+
+// Synchronised group command for several load banks (build with load_bank_io.c and -lpthread)
+// Sends the same SW or PHASE command to a set of boards so that they all step together:
+//	./load_bank_group SW 111111000000111111 serial:/dev/ttyUSB0 tcp:192.168.68.117:23
+// First every device is prepared (locked, opened or connected, and checked with a ZCS? query) and the message is encoded;
+// if any device fails to prepare, nothing is sent to any of them. Then one thread per device sleeps until a shared
+// absolute deadline and writes the message, and the spread of the actual write times (the skew) is reported.
+
+#define BUFSIZE ((GEOMETRY_BUFSIZE > 32) ? GEOMETRY_BUFSIZE + 1 : 32)	// also holds the length byte of a message
+#define MAX_DEVICES 16
+
+#define LOCK_TIMEOUT_MS 15000
+#define DEFAULT_COMMIT_DELAY_MS 50	// how far after preparation the shared deadline is set
+#define SPIN_US 300			// sleep until this long before the deadline, then spin, for a tighter release
+#define RESPONSE_TIMEOUT_MS 12000	// longer than the 10 s zero-crossing timeout of the board
+
+// ************************************ DATA REPRESENTATION CONVERSION UTILITIES ********************************** //
+
+// encode a SW or PHASE command with its value into msg (length byte first, ready to write)
+// return the number of bytes to write, or -1 if the value is bad
+int encode_msg (char *command, char *value, char *msg)
+{
+	if (strlen(value) != NUM_SWITCHES) {
+		return -1;
+	}
+	if (strcmp(command, "SW") == 0) {
+		mask_t mask = 0;
+		for (int i = 0; i < NUM_SWITCHES; i++) {
+			if (value[i] == '1') {
+				mask |= MASK_BIT(i);
+			} else if (value[i] != '0') {
+				return -1;
+			}
+		}
+		msg[0] = SW_MSG_LEN;
+		memcpy(msg + 1, "SW ", 3);
+		mask_to_buf(msg + 4, mask);
+		msg[SW_MSG_LEN] = '\n';
+		return SW_MSG_LEN + 1;
+	} else if (strcmp(command, "PHASE") == 0) {
+		mask_t phase_masks[NUM_PHASES] = { 0 };
+		for (int i = 0; i < NUM_SWITCHES; i++) {
+			if (value[i] < '1' || value[i] >= '1' + NUM_PHASES) {
+				return -1;
+			}
+			phase_masks[value[i] - '1'] |= MASK_BIT(i);
+		}
+		msg[0] = PHASE_MSG_LEN;
+		memcpy(msg + 1, "PHASE ", 6);
+		for (int p = 0; p < NUM_PHASES; p++) {
+			mask_to_buf(msg + 7 + (p * MASK_BYTES), phase_masks[p]);
+		}
+		msg[PHASE_MSG_LEN] = '\n';
+		return PHASE_MSG_LEN + 1;
+	}
+	return -1;
+}
+
+// **************************************************** SYSTEM UTILITIES *************************************** //
+
+// current time in microseconds on the given clock
+long long now_us (clockid_t clock)
+{
+	struct timespec now;
+	clock_gettime(clock, &now);
+	return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// ****************************************************** GROUP EXECUTION ***************************************** //
+
+typedef struct {
+	char *spec;			// as given on the command line, eg. serial:/dev/ttyUSB0 or tcp:192.168.68.117:23
+	lbio_conn_t conn;
+	lbio_request_t req;
+	int lock_fd;			// -1 for tcp devices
+	char *msg;			// encoded message (shared by all devices)
+	int msg_len;
+	long long deadline_us;		// CLOCK_REALTIME time to write at
+	long long written_us;		// CLOCK_REALTIME time the write returned
+	long long replied_us;		// CLOCK_REALTIME time the reply was read
+	char reply[BUFSIZE];
+} device_t;
+
+// lock and open (or connect to) a device and check it answers; return 0 on success
+int prepare_device (device_t *dev)
+{
+	dev->lock_fd = -1;
+	if (strncmp(dev->spec, "serial:", 7) == 0) {
+		dev->lock_fd = lbio_lock_acquire(dev->spec + 7, LOCK_TIMEOUT_MS, "GROUP", NULL, 0);
+		if (dev->lock_fd < 0) {
+			sprintf(dev->reply, "ERR BUSY");
+			return -1;
+		}
+	} else if (strncmp(dev->spec, "tcp:", 4) != 0) {
+		sprintf(dev->reply, "ERR BAD DEVICE");
+		return -1;
+	}
+	if (lbio_open(&dev->conn, dev->spec) == -1) {
+		sprintf(dev->reply, "ERR OPEN");
+		return -1;
+	}
+
+	// a status query confirms the board is there and leaves the link warmed up
+	if (lbio_exchange(&dev->conn, "ZCS?\n", 5, NULL, 0, 1000) != LBIO_OK) {
+		sprintf(dev->reply, "ERR NO RESPONSE");
+		return -1;
+	}
+	dev->reply[0] = '\0';
+	return 0;
+}
+
+// per-device commit thread: wait for the shared deadline, write, and wait for the reply
+void *commit_device (void *arg)
+{
+	device_t *dev = (device_t *) arg;
+
+	// sleep until shortly before the deadline, then spin so that wakeup latency does not add to the skew
+	long long wake_us = dev->deadline_us - SPIN_US;
+	struct timespec wake = { wake_us / 1000000, (wake_us % 1000000) * 1000 };
+	while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &wake, NULL) == EINTR);
+	while (now_us(CLOCK_REALTIME) < dev->deadline_us);
+
+	// nothing else is queued on the connection, so the message is written before lbio_submit returns
+	lbio_submit(&dev->conn, &dev->req, dev->msg + 1, dev->msg_len - 1, RESPONSE_TIMEOUT_MS, NULL, NULL);
+	dev->written_us = now_us(CLOCK_REALTIME);
+
+	if (lbio_wait(&dev->conn, &dev->req) == LBIO_OK) {
+		strncpy(dev->reply, dev->req.reply, BUFSIZE - 1);
+		dev->reply[BUFSIZE - 1] = '\0';
+	} else {
+		sprintf(dev->reply, "ERR NO RESPONSE");
+	}
+	dev->replied_us = now_us(CLOCK_REALTIME);
+	return NULL;
+}
+
+// close every device that was opened or locked
+void release_devices (device_t *devs, int num_devs)
+{
+	for (int i = 0; i < num_devs; i++) {
+		if (devs[i].conn.fd != -1) {
+			lbio_close(&devs[i].conn);
+		}
+		if (devs[i].lock_fd >= 0) {
+			lbio_lock_release(devs[i].lock_fd);
+		}
+	}
+}
+
+// ************************************************************ MAIN FUNCTION ***************************************** //
+
+int main (int argc, char **argv)
+{
+	int delay_ms = DEFAULT_COMMIT_DELAY_MS;
+	int opt;
+	while ((opt = getopt(argc, argv, "d:")) != -1) {
+		if (opt == 'd') {
+			delay_ms = atoi(optarg);
+		} else {
+			printf("{\"status\": \"Bad Request\", \"msg\": \"usage: load_bank_group [-d commit delay ms] SW|PHASE value device...\"}\n");
+			return 1;
+		}
+	}
+	int num_devs = argc - optind - 2;
+	if (num_devs < 1 || num_devs > MAX_DEVICES) {
+		printf("{\"status\": \"Bad Request\", \"msg\": \"Give a command, a value and between 1 and %d devices\"}\n", MAX_DEVICES);
+		return 1;
+	}
+	char *command = argv[optind];
+	char *value = argv[optind + 1];
+
+	// encode once; every device gets the same bytes
+	char msg[BUFSIZE];
+	int msg_len = encode_msg(command, value, msg);
+	if (msg_len == -1) {
+		printf("{\"status\": \"Bad Request\", \"msg\": \"Command must be SW or PHASE with an %d character value\"}\n", NUM_SWITCHES);
+		return 1;
+	}
+
+	// prepare every device, and give up on the whole group if any of them cannot take part
+	device_t devs[MAX_DEVICES];
+	for (int i = 0; i < num_devs; i++) {
+		devs[i] = (device_t) { .spec = argv[optind + 2 + i], .conn.fd = -1, .lock_fd = -1, .msg = msg, .msg_len = msg_len };
+	}
+	for (int i = 0; i < num_devs; i++) {
+		if (prepare_device(&devs[i]) != 0) {
+			char spec[2 * 128], reply[2 * BUFSIZE];
+			lbio_json_escape(spec, sizeof(spec), devs[i].spec);
+			lbio_json_escape(reply, sizeof(reply), devs[i].reply);
+			printf("{\"status\": \"Service Unavailable\", \"msg\": \"Could not prepare %s (%s); nothing was sent\"}\n", spec, reply);
+			release_devices(devs, num_devs);
+			return 1;
+		}
+	}
+
+	// commit: release every write at the same absolute time
+	long long deadline_us = now_us(CLOCK_REALTIME) + delay_ms * 1000LL;
+	pthread_t threads[MAX_DEVICES];
+	for (int i = 0; i < num_devs; i++) {
+		devs[i].deadline_us = deadline_us;
+		pthread_create(&threads[i], NULL, commit_device, &devs[i]);
+	}
+	for (int i = 0; i < num_devs; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	release_devices(devs, num_devs);
+
+	// report how closely the writes matched the deadline and each other
+	long long first = devs[0].written_us, last = devs[0].written_us;
+	int all_ok = 1;
+	for (int i = 0; i < num_devs; i++) {
+		first = (devs[i].written_us < first) ? devs[i].written_us : first;
+		last = (devs[i].written_us > last) ? devs[i].written_us : last;
+		all_ok &= (strncmp(devs[i].reply, "OK", 2) == 0);
+	}
+	printf("{\"status\": \"%s\", \"command\": \"%s %s\", \"skew_us\": %lld, \"devices\": [", all_ok ? "OK" : "Partial Failure", command, value, last - first);
+	for (int i = 0; i < num_devs; i++) {
+		// strip the trailing newline from the board's reply; the device spec comes from the client, so both are escaped
+		devs[i].reply[strcspn(devs[i].reply, "\n")] = '\0';
+		char spec[2 * 128], reply[2 * BUFSIZE];
+		lbio_json_escape(spec, sizeof(spec), devs[i].spec);
+		lbio_json_escape(reply, sizeof(reply), devs[i].reply);
+		printf("%s{\"device\": \"%s\", \"write_offset_us\": %lld, \"reply_us\": %lld, \"reply\": \"%s\"}", (i > 0) ? ", " : "",
+			spec, devs[i].written_us - deadline_us, devs[i].replied_us - devs[i].written_us, reply);
+	}
+	printf("]}\n");
+
+	return all_ok ? 0 : 1;
+}
@@ -5,130 +5,530 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <termios.h>
-#include <semaphore.h>
+#include <time.h>
+#include <errno.h>
+#include <libgen.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/serial.h>
+#include <linux/perf_event.h>
 
-#define BUFSIZE 32
-#define NUM_SWITCHES 18
+#include "load_bank_io.h"
+#include "load_bank_geometry.h"
+
+#define BUFSIZE ((GEOMETRY_BUFSIZE > 32) ? GEOMETRY_BUFSIZE : 32)
+
+#define TRACE_FILE_ENV_NAME "LOAD_BANK_TRACE_FILE"	// chrome trace file to append spans to (set by the api server for sampled requests)
+#define TRACE_ID_ENV_NAME "LOAD_BANK_TRACE_ID"		// id of the api request being traced
+#define PROFILE_FILE_ENV_NAME "LOAD_BANK_PROFILE_FILE"	// file to append per-phase performance counter readings to (off if unset)
 
-#define SEMAPHORE_NAME "/usbfd-sem"	// semaphore on the file descriptor to prevent attempted parallel access to file descriptor
 #define FTDI_DEVICE_NAME "/dev/ttyUSB0"	// name of ftdi chip on the raspberry pi; opening this device allows us to talk to the board
+#define DEVICE_ENV_NAME "LOAD_BANK_DEVICE"	// overrides FTDI_DEVICE_NAME (eg. to talk to load_bank_sim instead)
 
-// ************************************ DATA REPRESENTATION CONVERSION UTILITIES ********************************** //
+#define TRANSPORT_ENV_NAME "LOAD_BANK_TRANSPORT"	// "serial" (default) or "tcp:<host>:<port>" to reach the same board through the netburner
+#define WRITE_RESPONSE_TIMEOUT_MS 12000		// switch commands can wait up to 10 s for a zero crossing before the board answers
+#define QUERY_RESPONSE_TIMEOUT_MS 2000		// everything else is answered straight away
 
-// convert from 4-char buffer to 32-bit bitmask
-uint32_t buf_to_mask (char *buf)
-{
-	uint32_t mask = 0;
-	mask = (((uint32_t)buf[0]) << 24) | (((uint32_t)buf[1]) << 16) | (((uint32_t)buf[2]) << 8) | (uint32_t)buf[3];
+#define EXIT_NOT_SENT 3		// exit status when the board could not be reached: nothing of this run was sent, so the command may be retried on another path
+#define EXIT_NO_RESPONSE 4	// exit status when a message was sent but not answered: a write may or may not have been applied
 
-	return mask;
-}
+#define LOCK_TIMEOUT_MS 15000		// give up waiting for the device after this long (overridden by LOAD_BANK_LOCK_TIMEOUT_MS)
+#define LOCK_TIMEOUT_ENV_NAME "LOAD_BANK_LOCK_TIMEOUT_MS"
 
-// convert from 32-bit bitmask to 4-char buffer
-void mask_to_buf (char *buf, uint32_t mask)
-{
-	buf[0] = (char)((mask >> 24) & 0b11111111);
-	buf[1] = (char)((mask >> 16) & 0b11111111);
-	buf[2] = (char)((mask >> 8) & 0b11111111);
-	buf[3] = (char)(mask & 0b11111111);
-}
+#define LOW_LATENCY_ENV_NAME "LOAD_BANK_LOW_LATENCY"		// set to 1 to put the ftdi chip in low latency mode on open
+#define LATENCY_TIMER_ENV_NAME "LOAD_BANK_LATENCY_TIMER_MS"	// latency timer to set in low latency mode (default below)
+#define DEFAULT_LATENCY_TIMER_MS 1				// the ftdi default is 16 ms, which delays every response
+#define LATENCY_TIMER_SYSFS "/sys/bus/usb-serial/devices/%s/latency_timer"
+#define MAX_LATENCY_SAMPLES 1000
+#define MAX_ARGS (2 + ((NUM_PHASES > 5) ? NUM_PHASES : 5))	// program and command, then at most 5 SWPATCH operations or one PHASEPATCH operation per phase
+
+// ************************************ DATA REPRESENTATION CONVERSION UTILITIES ********************************** //
+
+// (buf_to_mask and mask_to_buf, which depend on the mask width, are in load_bank_geometry.h)
 
-// convert from string of length 18 consisting of 1s and 0s to 32-bit bitmask (for switch state representation)
-uint32_t binstring_to_mask (char *buf)
+// convert from string of NUM_SWITCHES 1s and 0s to bitmask (for switch state representation)
+// return 0 on success, -1 if there is any other character
+int binstring_to_mask (char *buf, mask_t *mask)
 {
-	uint32_t mask = 0;
+	*mask = 0;
 	for (int i = 0; i < NUM_SWITCHES; i++) {
 		if (buf[i] == '\n') {
 			break;
 		}
 		if (buf[i] == '1') {
-			mask |= (1 << i);
-		} else if (buf[i] == '0') {
-			mask &= ~(1 << i);
-		} else {
-			return 0xFFFFFFFF;
+			*mask |= MASK_BIT(i);
+		} else if (buf[i] != '0') {
+			return -1;
 		}
 	}
-	return mask;
+	return 0;
 }
 
-// convert from 4-char buffer to string of length 18 consisting of 1s and 0s (for switch state representation)
+// convert from MASK_BYTES-char buffer to string of NUM_SWITCHES 1s and 0s (for switch state representation)
 void buf_to_binstring (char *buf, char *binstring)
 {
-	// convert to 32-bit mask first
-	uint32_t mask = buf_to_mask(buf);
-
-	// go through the mask and generate binstring
-	int i;
-	for (i = 0; i < NUM_SWITCHES; i++) {
-		if (mask & (1 << i)) {
-			binstring[i] = '1';
-		} else {
-			binstring[i] = '0';
-		}
-	}
-	binstring[i] = '\0';
+	mask_to_chars(buf_to_mask(buf), binstring);
+	binstring[NUM_SWITCHES] = '\0';
 }
 
-// convert from string of 1s, 2s, and 3s (the "phasestring") to three 4-char buffers in a row (for phase state representation)
+// convert from string of phase numbers (the "phasestring", eg. 111111222222333333) to NUM_PHASES MASK_BYTES-char buffers
+// in a row (for phase state representation)
 // return 0 on success, -1 on failure
 int phasestring_to_bufs (char *phasestring, char *bufs)
 {
-	// convert the phasestring into three bitmasks
-	uint32_t phase1_mask = 0, phase2_mask = 0, phase3_mask = 0;
+	// convert the phasestring into one bitmask per phase
+	mask_t phase_masks[NUM_PHASES] = { 0 };
 	for (int i = 0; i < NUM_SWITCHES; i++) {
-		if (phasestring[i] == '1') {
-			phase1_mask |= (1 << i);
-		} else if (phasestring[i] == '2') {
-			phase2_mask |= (1 << i);
-		} else if (phasestring[i] == '3') {
-			phase3_mask |= (1 << i);
-		} else {
+		int phase = phasestring[i] - '1';
+		if (phase < 0 || phase >= NUM_PHASES) {
 			// bad request!
 			return -1;
 		}
+		phase_masks[phase] |= MASK_BIT(i);
 	}
 
-	// then put the three bitmasks into bufs sequentially
-	mask_to_buf(bufs, phase1_mask);
-	mask_to_buf(bufs + 4, phase2_mask);
-	mask_to_buf(bufs + 8, phase3_mask);
+	// then put the bitmasks into bufs sequentially
+	for (int p = 0; p < NUM_PHASES; p++) {
+		mask_to_buf(bufs + (p * MASK_BYTES), phase_masks[p]);
+	}
 
 	return 0;
 }
 
-// convert from three 4-char buffers in a row to string of 1s, 2s, and 3s (the "phasestring") (for phase state representation)
+// convert from NUM_PHASES MASK_BYTES-char buffers in a row to the phasestring (for phase state representation)
 void bufs_to_phasestring (char *bufs, char *phasestring)
 {
-	// extract the three bitmasks from  the bufs string
-	uint32_t phase1_mask = buf_to_mask(bufs);
-	uint32_t phase2_mask = buf_to_mask(bufs + 4);
-	uint32_t phase3_mask = buf_to_mask(bufs + 8);
-
-	// convert three bitmasks into phasestring
-	int i;
-	for (i = 0; i < NUM_SWITCHES; i++) {
-		if (phase1_mask & (1 << i)) {
-			phasestring[i] = '1';
-		} else if (phase2_mask & (1 << i)) {
-			phasestring[i] = '2';
-		} else if (phase3_mask & (1 << i)) {
-			phasestring[i] = '3';
-		} else {
-			printf("Fatal Error? Should not get here...\n");
+	// every switch is on exactly one phase; fill in the phases from the last so that the first one wins any overlap
+	memset(phasestring, '?', NUM_SWITCHES);
+	for (int p = NUM_PHASES - 1; p >= 0; p--) {
+		mask_t mask = buf_to_mask(bufs + (p * MASK_BYTES));
+		for (int i = 0; i < NUM_SWITCHES; i++, mask >>= 1) {
+			if (mask & 1) {
+				phasestring[i] = '1' + p;
+			}
+		}
+	}
+	phasestring[NUM_SWITCHES] = '\0';
+}
+
+// convert a list of switches to a bitmask (for partial updates)
+// the list is either a string of NUM_SWITCHES 1s and 0s, or switch numbers and ranges counted from 1, eg. "1-6,9,12"
+// return 0 on success, -1 on failure
+int switch_list_to_mask (char *list, mask_t *mask)
+{
+	*mask = 0;
+	if (strlen(list) == NUM_SWITCHES && strspn(list, "01") == NUM_SWITCHES) {
+		return binstring_to_mask(list, mask);
+	}
+
+	char *pos = list;
+	while (*pos != '\0') {
+		char *end;
+		long first = strtol(pos, &end, 10);
+		long last = first;
+		if (end == pos) {
+			return -1;
+		}
+		if (*end == '-') {
+			pos = end + 1;
+			last = strtol(pos, &end, 10);
+			if (end == pos) {
+				return -1;
+			}
+		}
+		if (first < 1 || last > NUM_SWITCHES || first > last) {
+			return -1;
+		}
+		for (long i = first; i <= last; i++) {
+			*mask |= MASK_BIT(i - 1);
+		}
+		if (*end == ',') {
+			end++;
+		} else if (*end != '\0') {
+			return -1;
+		}
+		pos = end;
+	}
+	return 0;
+}
+
+// ************************************************ STAGED TRANSITION PLANNER ************************************ //
+
+// plan a staged transition from switch mask cur to switch mask target in which no step changes more than max_relays relays
+// or switches more than max_kw of load on any single phase (a limit of 0 means no limit)
+// phase_masks holds the NUM_PHASES phase definitions (as reported by PHASE?) and ratings the kW rating of each switch
+// the intermediate masks (the last one being target) are written into steps, and the number of steps is returned
+// relays are packed into steps first-fit in order of decreasing rating, which is optimal when all ratings are equal
+int plan_transition (mask_t cur, mask_t target, mask_t *phase_masks, float *ratings, int max_relays, float max_kw, mask_t *steps)
+{
+	mask_t changed = (cur ^ target) & ALL_SWITCHES;
+	if (changed == 0) {
+		return 0;
+	}
+
+	// collect the switches that have to change, sorted by decreasing rating (insertion sort; there are at most NUM_SWITCHES)
+	int order[NUM_SWITCHES];
+	int num_changed = 0;
+	for (int i = 0; i < NUM_SWITCHES; i++) {
+		if (!(changed & MASK_BIT(i))) {
+			continue;
+		}
+		int j = num_changed++;
+		while (j > 0 && ratings[order[j - 1]] < ratings[i]) {
+			order[j] = order[j - 1];
+			j--;
+		}
+		order[j] = i;
+	}
+
+	// place each switch into the first step that still has room for it on its phase and in its relay count
+	mask_t step_bits[NUM_SWITCHES];
+	int step_relays[NUM_SWITCHES];
+	float step_kw[NUM_SWITCHES][NUM_PHASES + 1];	// index 0 collects switches not assigned to any phase
+	int num_steps = 0;
+	for (int k = 0; k < num_changed; k++) {
+		int sw = order[k];
+		int phase = 0;
+		for (int p = 0; p < NUM_PHASES; p++) {
+			if (phase_masks[p] & MASK_BIT(sw)) {
+				phase = p + 1;
+				break;
+			}
+		}
+
+		int s;
+		for (s = 0; s < num_steps; s++) {
+			if (max_relays > 0 && step_relays[s] >= max_relays) {
+				continue;
+			}
+			// a switch rated above max_kw on its own still gets a step, but never shares one on its phase
+			if (max_kw > 0 && step_kw[s][phase] > 0 && step_kw[s][phase] + ratings[sw] > max_kw) {
+				continue;
+			}
+			break;
+		}
+		if (s == num_steps) {
+			step_bits[s] = 0;
+			step_relays[s] = 0;
+			for (int p = 0; p <= NUM_PHASES; p++) {
+				step_kw[s][p] = 0;
+			}
+			num_steps++;
+		}
+		step_bits[s] |= MASK_BIT(sw);
+		step_relays[s]++;
+		step_kw[s][phase] += ratings[sw];
+	}
+
+	// turn the groups of changing switches into the sequence of masks to send
+	mask_t mask = cur & ALL_SWITCHES;
+	for (int s = 0; s < num_steps; s++) {
+		mask ^= step_bits[s];
+		steps[s] = mask;
+	}
+	return num_steps;
+}
+
+// ******************************************************* TRACING UTILITIES ************************************* //
+
+int trace_fd = -1;		// file descriptor of the trace file, or -1 if this request is not being traced
+char *trace_id = NULL;		// id of the api request being traced
+
+// start tracing if the api server asked for this request to be traced
+void trace_init ()
+{
+	char *file = getenv(TRACE_FILE_ENV_NAME);
+	trace_id = getenv(TRACE_ID_ENV_NAME);
+	if (file == NULL || trace_id == NULL) {
+		return;
+	}
+	// O_APPEND so that each span line lands whole at the end of the file the api server is also writing to
+	trace_fd = open(file, O_WRONLY | O_APPEND);
+}
+
+// current time in microseconds since the epoch, or 0 if not tracing
+long long trace_now_us ()
+{
+	if (trace_fd == -1) {
+		return 0;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// record a span called name that started at start_us and ended at end_us
+void trace_span_between (char *name, long long start_us, long long end_us)
+{
+	if (trace_fd == -1) {
+		return;
+	}
+	char event[256];
+	int len = snprintf(event, sizeof(event),
+		"{\"name\": \"%s\", \"cat\": \"serial\", \"ph\": \"X\", \"ts\": %lld, \"dur\": %lld, \"pid\": 1, \"tid\": %s, \"args\": {\"trace_id\": %s, \"pid\": %d}},\n",
+		name, start_us, end_us - start_us, trace_id, trace_id, getpid());
+	write(trace_fd, event, len);
+}
+
+// record a span called name that started at start_us and ends now
+void trace_span (char *name, long long start_us)
+{
+	trace_span_between(name, start_us, trace_now_us());
+}
+
+// ***************************************************** PROFILING UTILITIES ************************************ //
+
+// Opt-in profiling of where the time of a command goes: performance counters are read at every change of phase
+// and the difference is added to the phase that just ended. The phases follow each other rather than nest, so
+// every counted event lands in exactly one phase. One JSON line per command is appended to the profile file.
+// (setup covers taking the device lock and opening the device, and closing and releasing it at the end)
+enum { PHASE_SETUP, PHASE_PARSE, PHASE_ENCODE, PHASE_WRITE, PHASE_READ, PHASE_DECODE, PHASE_EMIT, NUM_PROFILE_PHASES };
+char *profile_phase_names[NUM_PROFILE_PHASES] = { "setup", "parse", "encode", "write", "read", "decode", "emit" };
+
+// counters to read; the hardware ones are missing on some kernels and in most virtual machines, and are then
+// reported as null while the software ones (which the kernel always has) still work
+typedef struct {
+	char *name;
+	uint32_t type;
+	uint64_t config;
+} profile_counter_t;
+
+const profile_counter_t profile_counters[] = {
+	{ "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ "cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ "task_clock_ns", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+	{ "context_switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+	{ "page_faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+};
+#define NUM_PROFILE_COUNTERS (sizeof(profile_counters) / sizeof(profile_counters[0]))
+
+int profile_fd = -1;				// profile file, or -1 if not profiling
+int profile_counter_fds[NUM_PROFILE_COUNTERS];	// -1 for counters that could not be opened
+int profile_kernel = 1;				// 1 if time spent in the kernel (syscalls) is counted
+int profile_current = -1;			// phase being counted, or -1
+uint64_t profile_last[NUM_PROFILE_COUNTERS];
+uint64_t profile_totals[NUM_PROFILE_PHASES][NUM_PROFILE_COUNTERS];
+int profile_entries[NUM_PROFILE_PHASES];
+char profile_command[128];			// command, escaped for the report
+
+// open one counter on this process, counting kernel time too unless profile_kernel has been cleared
+int profile_counter_open (const profile_counter_t *counter)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = counter->type;
+	attr.config = counter->config;
+	attr.exclude_kernel = !profile_kernel;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+// switch to counting phase (-1 to stop counting)
+void profile_phase (int phase)
+{
+	if (profile_fd == -1) {
+		return;
+	}
+	for (size_t i = 0; i < NUM_PROFILE_COUNTERS; i++) {
+		uint64_t now = 0;
+		if (profile_counter_fds[i] == -1 || read(profile_counter_fds[i], &now, sizeof(now)) != sizeof(now)) {
+			continue;
+		}
+		if (profile_current != -1) {
+			profile_totals[profile_current][i] += now - profile_last[i];
+		}
+		profile_last[i] = now;
+	}
+	profile_current = phase;
+	if (phase != -1) {
+		profile_entries[phase]++;
+	}
+}
+
+// append the totals of each phase to the profile file (registered with atexit, so it also runs when a command fails)
+void profile_report ()
+{
+	if (profile_fd == -1) {
+		return;
+	}
+	profile_phase(-1);
+	int hardware = (profile_counter_fds[0] != -1);
+
+	char line[4096];
+	size_t len = snprintf(line, sizeof(line), "{\"pid\": %d, \"command\": \"%s\", \"hardware\": %s, \"kernel\": %s, \"phases\": {",
+		getpid(), profile_command, hardware ? "true" : "false", profile_kernel ? "true" : "false");
+	for (size_t p = 0; p < NUM_PROFILE_PHASES && len < sizeof(line); p++) {
+		len += snprintf(line + len, sizeof(line) - len, "%s\"%s\": {\"entries\": %d", (p > 0) ? ", " : "", profile_phase_names[p], profile_entries[p]);
+		for (size_t i = 0; i < NUM_PROFILE_COUNTERS && len < sizeof(line); i++) {
+			if (profile_counter_fds[i] == -1) {
+				len += snprintf(line + len, sizeof(line) - len, ", \"%s\": null", profile_counters[i].name);
+			} else {
+				len += snprintf(line + len, sizeof(line) - len, ", \"%s\": %llu", profile_counters[i].name, (unsigned long long) profile_totals[p][i]);
+			}
 		}
+		len += snprintf(line + len, sizeof(line) - len, "}");
+	}
+	len += snprintf(line + len, sizeof(line) - len, "}}\n");
+	if (len < sizeof(line)) {
+		write(profile_fd, line, len);
+	}
+}
+
+// start profiling command if a profile file is set, counting from the setup phase
+void profile_init (char *command)
+{
+	char *file = getenv(PROFILE_FILE_ENV_NAME);
+	if (file == NULL) {
+		return;
+	}
+	profile_fd = open(file, O_WRONLY | O_APPEND | O_CREAT, 0644);
+	if (profile_fd == -1) {
+		return;
+	}
+	lbio_json_escape(profile_command, sizeof(profile_command), command);
+
+	// counting kernel time needs perf_event_paranoid <= 1 (or CAP_PERFMON); count user time only otherwise
+	int task_clock = 3;
+	int fd = profile_counter_open(&profile_counters[task_clock]);
+	if (fd == -1 && errno == EACCES) {
+		profile_kernel = 0;
+	}
+	if (fd != -1) {
+		close(fd);
+	}
+	for (size_t i = 0; i < NUM_PROFILE_COUNTERS; i++) {
+		profile_counter_fds[i] = profile_counter_open(&profile_counters[i]);
 	}
-	phasestring[i] = '\0';
+	atexit(profile_report);
+	profile_phase(PHASE_SETUP);
 }
 
 // **************************************************** SYSTEM UTILITIES *************************************** //
 
+// outcome of the low latency setup on the last serialport_open, for reporting
+int low_latency_flag = -1;		// 1 if ASYNC_LOW_LATENCY was set, 0 if not requested, -1 if the driver does not support it
+int latency_timer_before = -1;		// latency_timer the device had before any run lowered it (-1 if there is no such knob)
+int latency_timer_after = -1;		// latency_timer read back after setting it for this run
+
+// read an integer from a sysfs attribute, or -1 if it does not exist
+int sysfs_read_int (char *path)
+{
+	int value = -1;
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		return -1;
+	}
+	if (fscanf(f, "%d", &value) != 1) {
+		value = -1;
+	}
+	fclose(f);
+	return value;
+}
+
+// write an integer to a file (a sysfs attribute, or a plain file); return 0 on success, -1 if it could not be written
+int file_write_int (char *path, int value)
+{
+	FILE *f = fopen(path, "w");
+	if (f == NULL) {
+		return -1;
+	}
+	fprintf(f, "%d\n", value);
+	return (fclose(f) == 0) ? 0 : -1;
+}
+
+// set the ftdi latency timer through sysfs: lowered in low latency mode, and put back to what it was before otherwise
+// the sysfs setting outlives this process, so the value it had before the first run lowered it is kept in a file next
+// to the lock file (eg. /tmp/load_bank.ttyUSB0.latency_timer); without it a later run could not tell the original
+// value apart from one an earlier run left behind, and a run without low latency would not get the driver default
+void serialport_set_latency_timer (char *device_name, int low_latency)
+{
+	// the knob is found under the real tty name (device_name may be a symlink such as /dev/serial/by-id/...)
+	char real_name[256];
+	char path[512];
+	char saved_path[512];
+	if (realpath(device_name, real_name) == NULL) {
+		return;
+	}
+	snprintf(path, sizeof(path), LATENCY_TIMER_SYSFS, basename(real_name));
+	snprintf(saved_path, sizeof(saved_path), "%s/load_bank.%s.latency_timer", LBIO_LOCK_DIR, basename(real_name));
+	int current = sysfs_read_int(path);
+	if (current == -1) {
+		return;
+	}
+	int saved = sysfs_read_int(saved_path);
+	latency_timer_before = (saved != -1) ? saved : current;
+
+	int timer_ms = latency_timer_before;
+	if (low_latency) {
+		char *timer_env = getenv(LATENCY_TIMER_ENV_NAME);
+		timer_ms = (timer_env != NULL) ? atoi(timer_env) : DEFAULT_LATENCY_TIMER_MS;
+	}
+	if (current != timer_ms) {
+		// keep the original value before changing it for the first time
+		if (saved == -1) {
+			file_write_int(saved_path, current);
+		}
+		file_write_int(path, timer_ms);
+	}
+	latency_timer_after = sysfs_read_int(path);
+}
+
+// ask the usb-serial driver to pass received bytes on immediately instead of batching them
+// sets ASYNC_LOW_LATENCY on the port and lowers the ftdi latency_timer through sysfs
+// either step may be unavailable (other drivers, simulated devices, no permission to write sysfs); that is not an error
+void serialport_set_low_latency (int fd, char *device_name)
+{
+	// the serial driver flag
+	struct serial_struct serinfo;
+	if (ioctl(fd, TIOCGSERIAL, &serinfo) == 0) {
+		serinfo.flags |= ASYNC_LOW_LATENCY;
+		low_latency_flag = (ioctl(fd, TIOCSSERIAL, &serinfo) == 0) ? 1 : -1;
+	} else {
+		low_latency_flag = -1;
+	}
+	serialport_set_latency_timer(device_name, 1);
+}
+
+// name of the serial device to talk to
+char *get_device_name ()
+{
+	char *device_name = getenv(DEVICE_ENV_NAME);
+	if (device_name == NULL) {
+		device_name = FTDI_DEVICE_NAME;
+	}
+	return device_name;
+}
+
+// take exclusive ownership of the device, waiting at most timeout_ms for whoever holds it now (see lbio_lock_acquire)
+// the command is recorded in the lock file so that whoever is left waiting can see who has the device
+// returns the lock file descriptor (release it with lbio_lock_release), or -1 with an error message printed
+int device_lock_acquire (char *device_name, int timeout_ms, char *command)
+{
+	char holder[256];
+	long long start_us = lbio_now_us();
+	int lock_fd = lbio_lock_acquire(device_name, timeout_ms, command, holder, sizeof(holder));
+	if (lock_fd == LBIO_LOCK_ERROR) {
+		printf("{\"status\": \"Internal Server Error\", \"msg\": \"Could not open the lock file of %s\"}", device_name);
+		return -1;
+	} else if (lock_fd == LBIO_LOCK_BUSY) {
+		printf("{\"status\": \"Service Unavailable\", \"msg\": \"Device busy for %lld ms\", \"holder\": %s}",
+			(lbio_now_us() - start_us) / 1000, (holder[0] != '\0') ? holder : "null");
+		return -1;
+	}
+	return lock_fd;
+}
+
 // open a file descriptor to the serial device
 // errors here should return a 500 internal server error message
 int serialport_open ()
 {
 	// open the file descriptor
-	int fd = open(FTDI_DEVICE_NAME, O_RDWR | O_NOCTTY);
+	char *device_name = get_device_name();
+	long long span_start = trace_now_us();
+	int fd = open(device_name, O_RDWR | O_NOCTTY);
+	trace_span("open", span_start);
 	if (fd == -1) {
 		printf("{\"status\": \"Internal Server Error\", \"msg\": \"Unable to open port\"}");
 		return -1;
@@ -161,50 +561,150 @@ int serialport_open ()
 	toptions.c_cc[VTIME] = 0;	// never timeout on a read call (could cause hangs but hopefully not)
 
 	// save the changes we made to the options and have them take effect now
+	span_start = trace_now_us();
 	tcsetattr(fd, TCSANOW, &toptions);
 	if (tcsetattr(fd, TCSAFLUSH, &toptions) < 0) {
 		printf("{\"status\":  \"Internal Server Error\", \"msg\": \"Unable to get termnal attributes\"}");
 		return -1;
 	}
+	trace_span("tcsetattr", span_start);
+
+	// keep other (non-root) programs from opening the port while we use it; cleared when we close it or exit
+	ioctl(fd, TIOCEXCL);
+
+	// optionally cut the usb-serial receive latency
+	char *low_latency_env = getenv(LOW_LATENCY_ENV_NAME);
+	if (low_latency_env != NULL && strcmp(low_latency_env, "1") == 0) {
+		serialport_set_low_latency(fd, device_name);
+	} else {
+		// undo the latency timer of an earlier low latency run, so that this one really runs without it
+		low_latency_flag = 0;
+		serialport_set_latency_timer(device_name, 0);
+	}
 
 	return fd;
 }
 
-void wait_for_response (int usb_fd, char *ret)
+// open the path to the board chosen by LOAD_BANK_TRANSPORT (the ftdi serial link unless told otherwise)
+// on "tcp:<host>:<port>" the netburner, which relays the same protocol to the board over ethernet, is connected to instead
+// errors here should return a 500 internal server error message
+int device_open (lbio_conn_t *board)
 {
-	uint8_t len;
+	char *transport = getenv(TRANSPORT_ENV_NAME);
+	if (transport != NULL && strncmp(transport, "tcp:", 4) == 0) {
+		long long span_start = trace_now_us();
+		int result = lbio_open(board, transport);
+		trace_span("connect", span_start);
+		if (result == -1) {
+			printf("{\"status\": \"Internal Server Error\", \"msg\": \"Unable to connect to netburner\"}");
+		}
+		return result;
+	}
+	int fd = serialport_open();
+	lbio_attach(board, fd);
+	return (fd == -1) ? -1 : 0;
+}
+
+// how long the board gets to answer each message, from the start of the write to the end of the reply
+int response_timeout_ms = QUERY_RESPONSE_TIMEOUT_MS;
+
+// the message on the wire (the interface sends one message at a time and waits for its reply)
+lbio_request_t request;
+
+// set once any message of this run has gone out to the board: from then on a failure has to be reported as
+// EXIT_NO_RESPONSE, since an earlier write (a staged step, the write of a read-modify-write) may already have been applied
+int message_sent = 0;
+
+void write_msg (lbio_conn_t *board, char *msg, uint8_t len)
+{
+	profile_phase(PHASE_WRITE);
+	long long span_start = trace_now_us();
+	lbio_submit(board, &request, msg, len, response_timeout_ms, NULL, NULL);
+	trace_span("write", span_start);
+}
+
+// wait for the reply to the message written by write_msg and copy it into ret; if the board does not answer
+// in time, report it and exit (exiting releases the device lock; the caller cannot tell whether the board acted on it)
+void wait_for_response (lbio_conn_t *board, char *ret)
+{
+	profile_phase(PHASE_READ);
+	int status = lbio_wait(board, &request);
+	if (status == LBIO_NOT_SENT) {
+		printf("{\"status\": \"Internal Server Error\", \"msg\": \"Unable to write to the board\"}\n");
+		exit(message_sent ? EXIT_NO_RESPONSE : EXIT_NOT_SENT);
+	}
+	message_sent = 1;
+	if (status == LBIO_TIMEOUT) {
+		printf("{\"status\": \"Gateway Timeout\", \"msg\": \"No response from the board within %d ms\"}\n", response_timeout_ms);
+		exit(EXIT_NO_RESPONSE);
+	} else if (status != LBIO_OK) {
+		printf("{\"status\": \"Gateway Timeout\", \"msg\": \"Connection to the board closed\"}\n");
+		exit(EXIT_NO_RESPONSE);
+	}
 
-	// Read the message length
-	read(usb_fd, &len, 1);
+	// the library timestamps the reply on the monotonic clock; move them onto the trace clock
+	if (trace_fd != -1) {
+		long long offset = trace_now_us() - lbio_now_us();
+		trace_span_between("first_byte", request.written_us + offset, request.first_byte_us + offset);
+		trace_span_between("read", request.first_byte_us + offset, request.replied_us + offset);
+	}
+
+	// whatever the caller does with the reply counts as decoding it
+	profile_phase(PHASE_DECODE);
+	int len = (request.reply_len < BUFSIZE - 1) ? request.reply_len : BUFSIZE - 1;
+	memcpy(ret, request.reply, len);
+	ret[len] = '\0';
+}
+
+// timing of the exchanges of this request, reported with switch results so that the api server can work out how long
+// the board waited for a zero crossing (a switch round trip minus a query round trip) and where the crossings fall
+long long sw_rtt_us[NUM_SWITCHES];		// end of each accepted SW write to its OK (a staged request has one per step)
+long long sw_replied_us[NUM_SWITCHES];		// CLOCK_MONOTONIC time of each of those OKs
+int num_sw_timings = 0;
+long long query_rtt_us = -1;			// round trip of the last query, which the board answers without waiting
+
+// record the round trip of the query that was just answered
+void record_query_timing ()
+{
+	query_rtt_us = request.replied_us - request.written_us;
+}
 
-	// Read the payload of message one byte at a time into ret
-	// (inefficient but we do not care about speed in this step)
-	int i;
-	for (i = 0; i < len; i++) {
-		read(usb_fd, ret + i, 1);
+// record the round trip of the switch write that was just answered, if the board accepted it
+void record_sw_timing (char *ret)
+{
+	if (strncmp(ret, "OK", 2) == 0 && num_sw_timings < NUM_SWITCHES) {
+		sw_rtt_us[num_sw_timings] = request.replied_us - request.written_us;
+		sw_replied_us[num_sw_timings] = request.replied_us;
+		num_sw_timings++;
 	}
-	ret[i] = '\0';
 }
 
-void write_msg (int usb_fd, char *msg, uint8_t len)
+// print the timings recorded so far as a "zcs_timing" member of the result being printed (nothing if no switch was written)
+void print_zcs_timing ()
 {
-	// allocate a buffer
-	char *buf = (char *) malloc(len + 2);
-	buf[0] = (char) len;		// copy the length of the message into first byte of the buffer
-	memcpy(buf + 1, msg, len); 	// copy message to be sent into the buffer starting at the second byte
-	write(usb_fd, buf, len + 1); 	// send the message onto the file descriptor
-	free(buf);
+	if (num_sw_timings == 0) {
+		return;
+	}
+	printf(", \"zcs_timing\": {\"sw_rtt_us\": [");
+	for (int i = 0; i < num_sw_timings; i++) {
+		printf("%s%lld", (i > 0) ? ", " : "", sw_rtt_us[i]);
+	}
+	printf("], \"sw_replied_us\": [");
+	for (int i = 0; i < num_sw_timings; i++) {
+		printf("%s%lld", (i > 0) ? ", " : "", sw_replied_us[i]);
+	}
+	printf("], \"query_rtt_us\": %lld}", query_rtt_us);
 }
 
 // ***************************************************** MESSAGE HANDLING FUNCTIONS ******************************************* //
 
-void send_zcs_msg (int usb_fd, char *arg, char *ret)
+void send_zcs_msg (lbio_conn_t *board, char *arg, char *ret)
 {
 	// send the appropiate command
 	if (strncmp(arg, "ON", 2) == 0) {
-		write_msg(usb_fd, "ZCS ON\n", 7);
+		write_msg(board, "ZCS ON\n", 7);
 	} else if (strncmp(arg, "OFF", 3) == 0) {
-		write_msg(usb_fd, "ZCS OFF\n", 8);
+		write_msg(board, "ZCS OFF\n", 8);
 	} else {
 		// if the argument is bad, report it
 		sprintf(ret, "ERR BAD REQUEST\n");
@@ -212,38 +712,45 @@ void send_zcs_msg (int usb_fd, char *arg, char *ret)
 	}
 
 	// put the response from the c2000 into the return buffer (should always be "OK")
-	wait_for_response(usb_fd, ret);
+	wait_for_response(board, ret);
 }
 
-void send_sw_msg (int usb_fd, char *switches, char *ret)
+void send_sw_mask_msg (lbio_conn_t *board, mask_t desired_state, char *ret)
 {
+	// construct the message to be sent and send it
+	profile_phase(PHASE_ENCODE);
+	char msg[BUFSIZE];
+	sprintf(msg, "SW ");
+	mask_to_buf(msg + 3, desired_state);
+	msg[SW_MSG_LEN - 1] = '\n';
+	write_msg(board, msg, SW_MSG_LEN);
+
+	// put the response from the c2000 into the return buffer (should alwayse be "OK")
+	wait_for_response(board, ret);
+	record_sw_timing(ret);
+}
+
+void send_sw_msg (lbio_conn_t *board, char *switches, char *ret)
+{
+	profile_phase(PHASE_PARSE);
 	// if switches binstring is not exactly NUM_SWITCHES characters long, incorrect length
 	if (strlen(switches) != NUM_SWITCHES) {
 		sprintf(ret, "ERR BAD REQUEST\n");
 		return;
 	}
 
-	// get the 32-bit bit mask fromt the binstring
-	uint32_t desired_state = binstring_to_mask(switches);
-	if (desired_state == 0xFFFFFFFF) {
+	// get the bit mask from the binstring
+	mask_t desired_state;
+	if (binstring_to_mask(switches, &desired_state) != 0) {
 		// if there was an error converting to mask, report it and return
 		sprintf(ret, "ERR BAD REQUEST\n");
 		return;
 	}
 
-	// construct the message to be sent and send it
-	char msg[BUFSIZE];
-	sprintf(msg, "SW ");
-	mask_to_buf(msg + 3, desired_state);
-	msg[7] = '\n';
-	msg[8] = '\0';
-	write_msg(usb_fd, msg, 8);
-
-	// put the response from the c2000 into the return buffer (should alwayse be "OK")
-	wait_for_response(usb_fd, ret);
+	send_sw_mask_msg(board, desired_state, ret);
 }
 
-void send_phase_msg (int usb_fd, char *phasestring, char *ret)
+void send_phase_msg (lbio_conn_t *board, char *phasestring, char *ret)
 {
 	// if phasestring is not exactly NUM_SWITCHES characters long, incorrect length
 	if (strlen(phasestring) != NUM_SWITCHES) {
@@ -251,6 +758,7 @@ void send_phase_msg (int usb_fd, char *phasestring, char *ret)
 		return;
 	}
 
+	profile_phase(PHASE_ENCODE);
 	char msg[BUFSIZE];
 	sprintf(msg, "PHASE ");
 	if (phasestring_to_bufs(phasestring, msg + 6) != 0) {
@@ -260,43 +768,62 @@ void send_phase_msg (int usb_fd, char *phasestring, char *ret)
 	}
 
 	// construct the rest of the message to be send and send it
-	msg[18] = '\n';
-	msg[19] = '\0';
-	write_msg(usb_fd, msg, 19);
+	msg[PHASE_MSG_LEN - 1] = '\n';
+	write_msg(board, msg, PHASE_MSG_LEN);
 
 	// put the response from the c2000 into the return buffer (should always be "OK")
-	wait_for_response(usb_fd, ret);
+	wait_for_response(board, ret);
 }
 
-void send_zcs_query_msg (int usb_fd, char *ret)
+void send_phase_masks_msg (lbio_conn_t *board, mask_t *phase_masks, char *ret)
+{
+	// construct the message from the phase definitions and send it
+	profile_phase(PHASE_ENCODE);
+	char msg[BUFSIZE];
+	sprintf(msg, "PHASE ");
+	for (int p = 0; p < NUM_PHASES; p++) {
+		mask_to_buf(msg + 6 + (p * MASK_BYTES), phase_masks[p]);
+	}
+	msg[PHASE_MSG_LEN - 1] = '\n';
+	write_msg(board, msg, PHASE_MSG_LEN);
+
+	// put the response from the c2000 into the return buffer (should always be "OK")
+	wait_for_response(board, ret);
+}
+
+void send_zcs_query_msg (lbio_conn_t *board, char *ret)
 {
 	// send the appropriate command, and put the response into return buffer
-	write_msg(usb_fd, "ZCS?\n", 5);
-	wait_for_response(usb_fd, ret);
+	write_msg(board, "ZCS?\n", 5);
+	wait_for_response(board, ret);
+	record_query_timing();
 }
 
-void send_sw_query_msg (int usb_fd, char *ret)
+void send_sw_query_msg (lbio_conn_t *board, char *ret)
 {
 	// send the appropriate command, and put the response into the return buffer
-	write_msg(usb_fd, "SW?\n", 4);
-	wait_for_response(usb_fd, ret);
+	write_msg(board, "SW?\n", 4);
+	wait_for_response(board, ret);
+	record_query_timing();
 }
 
-void send_phase_query_msg (int usb_fd, char *ret)
+void send_phase_query_msg (lbio_conn_t *board, char *ret)
 {
 	// send the appropriate command, and put the response into the return buffer
-	write_msg(usb_fd, "PHASE?\n", 7);
-	wait_for_response(usb_fd, ret);
+	write_msg(board, "PHASE?\n", 7);
+	wait_for_response(board, ret);
+	record_query_timing();
 }
 
 // *************************************************** REQUEST HANDLING FUNCTIONS ***************************************** //
 
 // handle a standalone zcs query request from the client
-void handle_zcs_query_request (int usb_fd)
+void handle_zcs_query_request (lbio_conn_t *board)
 {
 	// send a query message to the c2000 and report back the data in a 200 ok message
 	char ret[BUFSIZE];
-	send_zcs_query_msg(usb_fd, ret);
+	send_zcs_query_msg(board, ret);
+	profile_phase(PHASE_EMIT);
 	if (strncmp(ret, "ZCS ON", 6) == 0) {
 		printf("{\"status\": \"OK\", \"zcs\": \"1\"}");
 	} else {
@@ -306,33 +833,54 @@ void handle_zcs_query_request (int usb_fd)
 
 
 // handle a standalone switch query request from the client
-void handle_sw_query_request (int usb_fd)
+void handle_sw_query_request (lbio_conn_t *board)
 {
 	// send a query message to the c2000 and report back the data in a 200 ok message
 	char ret[BUFSIZE];
 	char binstring[BUFSIZE];
-	send_sw_query_msg(usb_fd, ret);
+	send_sw_query_msg(board, ret);
 	buf_to_binstring(ret + 3, binstring);
-	printf("{\"status\": \"OK\", \"switches\": \"%s\"}", binstring);
+	profile_phase(PHASE_EMIT);
+	printf("{\"status\": \"OK\", \"switches\": \"%s\"", binstring);
+	print_zcs_timing();
+	printf("}");
 }
 
 // handle a standalone phase query request from the client
-void handle_phase_query_request (int usb_fd)
+void handle_phase_query_request (lbio_conn_t *board)
 {
 	// send a query message to the c2000 and report the data in a 200 ok message
 	char ret[BUFSIZE];
 	char phasestring[BUFSIZE];
-	send_phase_query_msg(usb_fd, ret);
+	send_phase_query_msg(board, ret);
 	bufs_to_phasestring(ret + 6, phasestring);
+	profile_phase(PHASE_EMIT);
 	printf("{\"status\": \"OK\", \"phases\": \"%s\"}", phasestring);
 }
 
+// handle a full state query from the client: the switch, phase and zcs queries back to back in this one session
+// (under the one device lock), so that a client needs a single request to show everything
+void handle_state_query_request (lbio_conn_t *board)
+{
+	char ret[BUFSIZE];
+	char binstring[BUFSIZE];
+	char phasestring[BUFSIZE];
+	send_sw_query_msg(board, ret);
+	buf_to_binstring(ret + 3, binstring);
+	send_phase_query_msg(board, ret);
+	bufs_to_phasestring(ret + 6, phasestring);
+	send_zcs_query_msg(board, ret);
+	profile_phase(PHASE_EMIT);
+	printf("{\"status\": \"OK\", \"switches\": \"%s\", \"phases\": \"%s\", \"zcs\": \"%c\"}", binstring, phasestring,
+		(strncmp(ret, "ZCS ON", 6) == 0) ? '1' : '0');
+}
+
 // handle a zcs request from the client
-void handle_zcs_request (int usb_fd, char *arg)
+void handle_zcs_request (lbio_conn_t *board, char *arg)
 {
 	// first, send a zcs command message to execute the specified command in arg
 	char ret[BUFSIZE];
-	send_zcs_msg(usb_fd, arg, ret);
+	send_zcs_msg(board, arg, ret);
 
 	// if the response from the c2000 is not "OK", print a 400 bad request message
 	if (strncmp(ret, "OK", 2) != 0) {
@@ -341,15 +889,95 @@ void handle_zcs_request (int usb_fd, char *arg)
 	}
 
 	// if we made it here, get the reported zcs status
-	handle_zcs_query_request(usb_fd);
+	handle_zcs_query_request(board);
+}
+
+// change the switches from cur to target in steps that each stay within max_relays and max_kw
+// the phase map is read from the c2000, a transition is planned, and each step is sent back to back so that each one
+// is applied on its own zero crossing, stopping at the first one the c2000 does not accept (its reply is left in ret)
+// returns the number of steps accepted, which is *num_steps if all of them were
+int send_staged_sw_steps (lbio_conn_t *board, mask_t cur, mask_t target, int max_relays, float max_kw, int *num_steps, long *plan_us, char *ret)
+{
+	send_phase_query_msg(board, ret);
+	mask_t phase_masks[NUM_PHASES];
+	for (int p = 0; p < NUM_PHASES; p++) {
+		phase_masks[p] = buf_to_mask(ret + 6 + (p * MASK_BYTES));
+	}
+
+	// plan the transition
+	float ratings[NUM_SWITCHES];
+	mask_t steps[NUM_SWITCHES];
+	struct timespec plan_start, plan_end;
+	lbio_load_ratings(ratings, NUM_SWITCHES);
+	clock_gettime(CLOCK_MONOTONIC, &plan_start);
+	*num_steps = plan_transition(cur, target, phase_masks, ratings, max_relays, max_kw, steps);
+	clock_gettime(CLOCK_MONOTONIC, &plan_end);
+	*plan_us = (plan_end.tv_sec - plan_start.tv_sec) * 1000000 + (plan_end.tv_nsec - plan_start.tv_nsec) / 1000;
+
+	// send the steps in order
+	for (int s = 0; s < *num_steps; s++) {
+		send_sw_mask_msg(board, steps[s], ret);
+		if (strncmp(ret, "OK", 2) != 0) {
+			return s;
+		}
+	}
+	return *num_steps;
+}
+
+// print the error for a staged switch change that stopped at step (counting from 0) of num_steps, given the board's reply
+void print_staged_sw_error (char *ret, int step, int num_steps)
+{
+	if (strncmp(ret, "ERR ZCS TMOUT", 13) == 0) {
+		printf("{\"status\": \"Request Timeout\", \"msg\": \"No Zero-Crossing detected for 10 seconds\", \"step\": %d, \"steps\": %d}", step + 1, num_steps);
+	} else {
+		printf("{\"status\": \"Bad Request\", \"msg\": \"Step rejected by the board\", \"step\": %d, \"steps\": %d}", step + 1, num_steps);
+	}
+}
+
+// handle a switch request that has to be carried out in limited steps (see send_staged_sw_steps)
+void handle_staged_sw_request (lbio_conn_t *board, char *arg, int max_relays, float max_kw)
+{
+	// validate the requested state the same way a direct switch request would
+	mask_t target;
+	if (strlen(arg) != NUM_SWITCHES || binstring_to_mask(arg, &target) != 0) {
+		printf("{\"status\": \"Bad Request\", \"msg\": \"Argument had incorrect length, or characters other than '0' or '1'\"}");
+		return;
+	}
+
+	// read the current switch state, then step towards the target
+	char ret[BUFSIZE];
+	send_sw_query_msg(board, ret);
+	mask_t cur = buf_to_mask(ret + 3);
+	int num_steps;
+	long plan_us;
+	int done = send_staged_sw_steps(board, cur, target, max_relays, max_kw, &num_steps, &plan_us, ret);
+	if (done < num_steps) {
+		print_staged_sw_error(ret, done, num_steps);
+		return;
+	}
+
+	// if we made it here, report the switch status along with how the transition was carried out
+	char binstring[BUFSIZE];
+	send_sw_query_msg(board, ret);
+	buf_to_binstring(ret + 3, binstring);
+	profile_phase(PHASE_EMIT);
+	printf("{\"status\": \"OK\", \"switches\": \"%s\", \"steps\": %d, \"plan_us\": %ld", binstring, num_steps, plan_us);
+	print_zcs_timing();
+	printf("}");
 }
 
 // handle a switch request from the client
-void handle_sw_request (int usb_fd, char *arg)
+// if max_relays or max_kw is nonzero, the change is split into steps that each stay within those limits
+void handle_sw_request (lbio_conn_t *board, char *arg, int max_relays, float max_kw)
 {
+	if (max_relays > 0 || max_kw > 0) {
+		handle_staged_sw_request(board, arg, max_relays, max_kw);
+		return;
+	}
+
 	// first, send a switch command message to execute the specified command in arg
 	char ret[BUFSIZE];
-	send_sw_msg(usb_fd, arg, ret);
+	send_sw_msg(board, arg, ret);
 
 	// if the response from the c2000 is not "OK", print a 400 bad request message
 	// if ZCS timout, then print a 408 request timeout message
@@ -363,15 +991,15 @@ void handle_sw_request (int usb_fd, char *arg)
 	}
 
 	// if we made it here, get the reported switch status
-	handle_sw_query_request(usb_fd);
+	handle_sw_query_request(board);
 }
 
 // handle a phase request from the client
-void handle_phase_request (int usb_fd, char *arg)
+void handle_phase_request (lbio_conn_t *board, char *arg)
 {
 	// first, send a phase command message to execute the specified command in arg
 	char ret[BUFSIZE];
-	send_phase_msg(usb_fd, arg, ret);
+	send_phase_msg(board, arg, ret);
 
 	// if the response from the c2000 is not "OK", print a 400 bad request message
 	if (strncmp(ret, "OK", 2) != 0) {
@@ -380,7 +1008,192 @@ void handle_phase_request (int usb_fd, char *arg)
 	}
 
 	// if we made it here, get the reported phase status
-	handle_phase_query_request(usb_fd);
+	handle_phase_query_request(board);
+}
+
+// handle a partial switch update: read the current state, apply each operation in ops (in order) and write the result,
+// all while holding the device, so that concurrent partial updates cannot lose each other
+// each operation is "on=<switches>", "off=<switches>" or "toggle=<switches>" (see switch_list_to_mask)
+// "max_relays=<n>" and "max_kw=<kW>" among them set step limits, as for a switch request; the result is then written in
+// steps that stay within them (see send_staged_sw_steps), and otherwise with a single switch command
+void handle_sw_patch_request (lbio_conn_t *board, char **args, int num_args)
+{
+	// work out what to change before touching the board
+	mask_t set_masks[3] = { 0 };		// per operation: the switches it applies to
+	int kinds[3];				// per operation: 0 to turn on, 1 to turn off, 2 to toggle
+	char *ops[3];
+	int num_ops = 0;
+	int max_relays = 0;
+	float max_kw = 0;
+	for (int i = 0; i < num_args; i++) {
+		if (strncmp(args[i], "max_relays=", 11) == 0) {
+			max_relays = atoi(args[i] + 11);
+		} else if (strncmp(args[i], "max_kw=", 7) == 0) {
+			max_kw = atof(args[i] + 7);
+		} else if (num_ops < 3) {
+			ops[num_ops++] = args[i];
+		} else {
+			num_ops = 4;
+		}
+	}
+	if (num_ops < 1 || num_ops > 3) {
+		printf("{\"status\": \"Bad Request\", \"msg\": \"Between one and three operations must be given\"}");
+		return;
+	}
+	for (int i = 0; i < num_ops; i++) {
+		char *list = strchr(ops[i], '=');
+		if (strncmp(ops[i], "on=", 3) == 0) {
+			kinds[i] = 0;
+		} else if (strncmp(ops[i], "off=", 4) == 0) {
+			kinds[i] = 1;
+		} else if (strncmp(ops[i], "toggle=", 7) == 0) {
+			kinds[i] = 2;
+		} else {
+			list = NULL;
+		}
+		if (list == NULL || switch_list_to_mask(list + 1, &set_masks[i]) != 0) {
+			printf("{\"status\": \"Bad Request\", \"msg\": \"Operation '%s' is not on=, off= or toggle= followed by switches like 1-6,9 or a string of 1s and 0s\"}", ops[i]);
+			return;
+		}
+	}
+
+	// read-modify-write
+	char ret[BUFSIZE];
+	send_sw_query_msg(board, ret);
+	mask_t cur = buf_to_mask(ret + 3) & ALL_SWITCHES;
+	mask_t desired = cur;
+	for (int i = 0; i < num_ops; i++) {
+		if (kinds[i] == 0) {
+			desired |= set_masks[i];
+		} else if (kinds[i] == 1) {
+			desired &= ~set_masks[i];
+		} else {
+			desired ^= set_masks[i];
+		}
+	}
+
+	// nothing to do if the switches are already as requested
+	int staged = (max_relays > 0 || max_kw > 0);
+	int num_steps = 0;
+	long plan_us = 0;
+	if (desired != cur && staged) {
+		int done = send_staged_sw_steps(board, cur, desired, max_relays, max_kw, &num_steps, &plan_us, ret);
+		if (done < num_steps) {
+			print_staged_sw_error(ret, done, num_steps);
+			return;
+		}
+		send_sw_query_msg(board, ret);
+	} else if (desired != cur) {
+		send_sw_mask_msg(board, desired, ret);
+		if (strncmp(ret, "OK", 2) != 0) {
+			if (strncmp(ret, "ERR ZCS TMOUT", 13) == 0) {
+				printf("{\"status\": \"Request Timeout\", \"msg\": \"No Zero-Crossing detected for 10 seconds\"}");
+			} else {
+				printf("{\"status\": \"Bad Request\", \"msg\": \"Switch command rejected by the board\"}");
+			}
+			return;
+		}
+		send_sw_query_msg(board, ret);
+	}
+
+	char binstring[BUFSIZE];
+	buf_to_binstring(ret + 3, binstring);
+	profile_phase(PHASE_EMIT);
+	printf("{\"status\": \"OK\", \"switches\": \"%s\", \"changed\": %s", binstring, (desired != cur) ? "true" : "false");
+	if (staged) {
+		printf(", \"steps\": %d, \"plan_us\": %ld", num_steps, plan_us);
+	}
+	print_zcs_timing();
+	printf("}");
+}
+
+// handle a partial phase update: read the current phase definitions, move the given switches to the given phases and
+// write the result with a single phase command, all while holding the device
+// each operation is "phase<N>=<switches>" (see switch_list_to_mask), eg. "phase2=1-6"
+void handle_phase_patch_request (lbio_conn_t *board, char **ops, int num_ops)
+{
+	mask_t moves[NUM_PHASES] = { 0 };	// switches to move onto each phase
+	if (num_ops < 1) {
+		printf("{\"status\": \"Bad Request\", \"msg\": \"No operations given\"}");
+		return;
+	}
+	for (int i = 0; i < num_ops; i++) {
+		int phase = (strncmp(ops[i], "phase", 5) == 0 && ops[i][5] != '\0' && ops[i][6] == '=') ? ops[i][5] - '1' : -1;
+		mask_t mask;
+		if (phase < 0 || phase >= NUM_PHASES || switch_list_to_mask(ops[i] + 7, &mask) != 0) {
+			printf("{\"status\": \"Bad Request\", \"msg\": \"Operation '%s' is not phase<1 to %d>= followed by switches like 1-6,9 or a string of 1s and 0s\"}", ops[i], NUM_PHASES);
+			return;
+		}
+		moves[phase] |= mask;
+	}
+
+	// read-modify-write
+	char ret[BUFSIZE];
+	mask_t phase_masks[NUM_PHASES];
+	send_phase_query_msg(board, ret);
+	for (int p = 0; p < NUM_PHASES; p++) {
+		phase_masks[p] = buf_to_mask(ret + 6 + (p * MASK_BYTES));
+	}
+	int changed = 0;
+	for (int p = 0; p < NUM_PHASES; p++) {
+		for (int q = 0; q < NUM_PHASES; q++) {
+			mask_t updated = (p == q) ? (phase_masks[q] | moves[p]) : (phase_masks[q] & ~moves[p]);
+			changed |= (updated != phase_masks[q]);
+			phase_masks[q] = updated;
+		}
+	}
+
+	if (changed) {
+		send_phase_masks_msg(board, phase_masks, ret);
+		if (strncmp(ret, "OK", 2) != 0) {
+			printf("{\"status\": \"Bad Request\", \"msg\": \"Phase command rejected by the board\"}");
+			return;
+		}
+		send_phase_query_msg(board, ret);
+	}
+
+	char phasestring[BUFSIZE];
+	bufs_to_phasestring(ret + 6, phasestring);
+	profile_phase(PHASE_EMIT);
+	printf("{\"status\": \"OK\", \"phases\": \"%s\", \"changed\": %s}", phasestring, changed ? "true" : "false");
+}
+
+// handle a latency measurement request: time num_samples ZCS? queries (which change nothing on the board)
+// and report the round trip times along with the state of the low latency settings
+void handle_latency_request (lbio_conn_t *board, int num_samples)
+{
+	if (num_samples < 1 || num_samples > MAX_LATENCY_SAMPLES) {
+		num_samples = 20;
+	}
+
+	long rtt_us[MAX_LATENCY_SAMPLES];
+	char ret[BUFSIZE];
+	for (int i = 0; i < num_samples; i++) {
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		send_zcs_query_msg(board, ret);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		rtt_us[i] = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+	}
+
+	// sort the samples for the percentiles (insertion sort; there are at most MAX_LATENCY_SAMPLES)
+	long total = 0;
+	for (int i = 0; i < num_samples; i++) {
+		long sample = rtt_us[i];
+		int j = i;
+		while (j > 0 && rtt_us[j - 1] > sample) {
+			rtt_us[j] = rtt_us[j - 1];
+			j--;
+		}
+		rtt_us[j] = sample;
+		total += sample;
+	}
+
+	profile_phase(PHASE_EMIT);
+	printf("{\"status\": \"OK\", \"low_latency\": %d, \"latency_timer_before\": %d, \"latency_timer_after\": %d, "
+		"\"samples\": %d, \"rtt_us\": {\"min\": %ld, \"mean\": %ld, \"p50\": %ld, \"p90\": %ld, \"max\": %ld}}",
+		low_latency_flag, latency_timer_before, latency_timer_after, num_samples,
+		rtt_us[0], total / num_samples, rtt_us[num_samples / 2], rtt_us[(num_samples * 9) / 10], rtt_us[num_samples - 1]);
 }
 
 // ************************************************************ MAIN FUNCTION ***************************************** //
@@ -389,34 +1202,71 @@ void handle_phase_request (int usb_fd, char *arg)
 // will output stuff to stdout
 int main (int argc, char **argv)
 {
-	// open the semaphore; create it if it doesn't already exist
-	sem_t *usb_fd_sem = sem_open(SEMAPHORE_NAME, O_CREAT, 0660, 1);
-	if (usb_fd_sem == SEM_FAILED) {
-		printf("{\"status\": \"Internal Server Error\", \"msg\": \"Could not open or create semaphore\"}");
+	// record spans if the api server is tracing this request
+	trace_init();
+
+	// take ownership of the device before opening it
+	char command[64] = "";
+	for (int i = 1; i < argc && i < 3; i++) {
+		strncat(command, argv[i], 20);
+		strcat(command, " ");
+	}
+	profile_init(command);
+	char *timeout_env = getenv(LOCK_TIMEOUT_ENV_NAME);
+	int lock_timeout_ms = (timeout_env != NULL) ? atoi(timeout_env) : LOCK_TIMEOUT_MS;
+	long long span_start = trace_now_us();
+	int lock_fd = device_lock_acquire(get_device_name(), lock_timeout_ms, command);
+	trace_span("lock_wait", span_start);
+	if (lock_fd == -1) {
+		printf("\n");
 		return 1;
 	}
-	// wait on the semaphore before opening the file descriptor
-	sem_wait(usb_fd_sem);
 
-	// open connection to ftdi device (which talks to the c2000 on the master board)
-	int usb_fd = serialport_open();
+	// open connection to ftdi device (which talks to the c2000 on the master board), or to the netburner in front of it
+	span_start = trace_now_us();
+	lbio_conn_t board_conn;
+	lbio_conn_t *board = &board_conn;
+	int open_result = device_open(board);
+	trace_span("serialport_open", span_start);
+	if (open_result == -1) {
+		printf("\n");
+		lbio_lock_release(lock_fd);
+		return EXIT_NOT_SENT;
+	}
+
+	// switch commands may have to wait for a zero crossing before the board answers
+	if (argc >= 2 && strncmp(argv[1], "SW", 2) == 0 && argv[1][2] != '?') {
+		response_timeout_ms = WRITE_RESPONSE_TIMEOUT_MS;
+	}
 
 	int ret = 0;
 
 	// determine what request was made
-	if (argc == 2 || argc == 3) {
+	profile_phase(PHASE_PARSE);
+	if (argc >= 2 && argc <= MAX_ARGS) {
 		if (strncmp(argv[1], "ZCS?", 4) == 0) {
-			handle_zcs_query_request(usb_fd);
+			handle_zcs_query_request(board);
 		} else if (strncmp(argv[1], "ZCS", 3) == 0) {
-			handle_zcs_request(usb_fd, argv[2]);
+			handle_zcs_request(board, argv[2]);
 		} else if (strncmp(argv[1], "SW?", 3) == 0) {
-			handle_sw_query_request(usb_fd);
+			handle_sw_query_request(board);
+		} else if (strncmp(argv[1], "SWPATCH", 7) == 0) {
+			handle_sw_patch_request(board, argv + 2, argc - 2);
 		} else if (strncmp(argv[1], "SW", 2) == 0) {
-			handle_sw_request(usb_fd, argv[2]);
+			// optional step limits: SW <switches> [max relays per step] [max kW per phase per step]
+			int max_relays = (argc >= 4) ? atoi(argv[3]) : 0;
+			float max_kw = (argc >= 5) ? atof(argv[4]) : 0;
+			handle_sw_request(board, argv[2], max_relays, max_kw);
 		} else if (strncmp(argv[1], "PHASE?", 6) == 0) {
-			handle_phase_query_request(usb_fd);
+			handle_phase_query_request(board);
+		} else if (strncmp(argv[1], "PHASEPATCH", 10) == 0) {
+			handle_phase_patch_request(board, argv + 2, argc - 2);
 		} else if (strncmp(argv[1], "PHASE", 5) == 0) {
-			handle_phase_request(usb_fd, argv[2]);
+			handle_phase_request(board, argv[2]);
+		} else if (strncmp(argv[1], "STATE?", 6) == 0) {
+			handle_state_query_request(board);
+		} else if (strncmp(argv[1], "LATENCY", 7) == 0) {
+			handle_latency_request(board, (argc >= 3) ? atoi(argv[2]) : 20);
 		} else {
 			// a request other than the ones defined above was made
 			if (argc == 2) {
@@ -432,12 +1282,18 @@ int main (int argc, char **argv)
 
 	// for nicer display of returned message
 	printf("\n");
+	if (profile_fd != -1) {
+		// write the result out now so that the write is counted as emitting it, then count the teardown as setup
+		profile_phase(PHASE_EMIT);
+		fflush(stdout);
+		profile_phase(PHASE_SETUP);
+	}
 
 	// close the file descriptor talking to the ftdi device
-	close(usb_fd);
+	lbio_close(board);
 
-	// post the semaphore so next access can proceed
-	sem_post(usb_fd_sem);
+	// release the device so next access can proceed
+	lbio_lock_release(lock_fd);
 
 	return ret;
 }
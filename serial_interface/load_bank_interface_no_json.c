@@ -3,12 +3,13 @@
 #include <string.h>
 #include <stdint.h>
 #include <unistd.h>
-#include <fcntl.h>
-#include <termios.h>
+
+#include "load_bank_io.h"
 
 #define BUFSIZE 32
 
 #define FTDI_DEVICE_NAME "/dev/ttyUSB0"
+#define RESPONSE_TIMEOUT_MS 12000	// longer than the 10 s zero-crossing timeout of the board
 
 // **************************************************** UTILITY FUNCTIONS ******************************************* //
 
@@ -46,20 +47,23 @@ uint32_t binstring_to_mask (char *buf) {
 	return mask;
 }
 
-void wait_for_response (int usb_fd)
+lbio_request_t request;		// the message on the wire (one at a time)
+
+void wait_for_response (lbio_conn_t *board)
 {
 	char msg[BUFSIZE];
-	uint8_t len;
-
-	// Read the message length
-	read(usb_fd, &len, 1);
 
-	// Read the payload of message
-	int i;
-	for (i = 0; i < len; i++) {
-		read(usb_fd, msg + i, 1);
+	// Wait for the reply to the message written by write_msg
+	if (lbio_wait(board, &request) != LBIO_OK) {
+		printf("No response from the board\n");
+		return;
+	}
+	size_t len = request.reply_len;
+	if (len > sizeof(msg) - 1) {
+		len = sizeof(msg) - 1;
 	}
-	msg[i] = '\0';
+	memcpy(msg, request.reply, len);
+	msg[len] = '\0';
 
 	// Print out the message
 	if (strncmp(msg, "SW", 2) == 0) {
@@ -86,31 +90,27 @@ void wait_for_response (int usb_fd)
 	}
 }
 
-void write_msg (int usb_fd, char *msg, uint8_t len)
+void write_msg (lbio_conn_t *board, char *msg, uint8_t len)
 {
-	char *buf = (char *) malloc(len + 2);
-	buf[0] = (char) len;
-	memcpy(buf + 1, msg, len); // copy message over
-	write(usb_fd, buf, len + 1); // send the buffer
-	free(buf);
+	lbio_submit(board, &request, msg, len, RESPONSE_TIMEOUT_MS, NULL, NULL);
 }
 
 // ***************************************************** MESSAGE HANDLING FUNCTIONS ******************************************* //
 
-void send_zcs_msg (int usb_fd, char *arg)
+void send_zcs_msg (lbio_conn_t *board, char *arg)
 {
 	if (strncmp(arg, "ON", 2) == 0) {
-		write_msg(usb_fd, "ZCS ON\n", 7);
+		write_msg(board, "ZCS ON\n", 7);
 	} else if (strncmp(arg, "OFF", 3) == 0) {
-		write_msg(usb_fd, "ZCS OFF\n", 8);
+		write_msg(board, "ZCS OFF\n", 8);
 	} else {
 		printf("Malformed argument to zcs command message\n");
 		return;
 	}
-	wait_for_response(usb_fd);
+	wait_for_response(board);
 }
 
-void send_sw_msg (int usb_fd, char *switches)
+void send_sw_msg (lbio_conn_t *board, char *switches)
 {
 	uint32_t desired_state = binstring_to_mask(switches);
 	if (desired_state == 0xFFFFFFFF) {
@@ -123,12 +123,12 @@ void send_sw_msg (int usb_fd, char *switches)
 	mask_to_buf(msg + 3, desired_state);
 	msg[7] = '\n';
 	msg[8] = '\0';
-	write_msg(usb_fd, msg, 8);
+	write_msg(board, msg, 8);
 
-	wait_for_response(usb_fd);
+	wait_for_response(board);
 }
 
-void send_phase_msg (int usb_fd, char **phases)
+void send_phase_msg (lbio_conn_t *board, char **phases)
 {
 	// 32-bit bitmask for holding the converted phase definitions
 	uint32_t phase_defs[3];
@@ -153,73 +153,27 @@ void send_phase_msg (int usb_fd, char **phases)
 	mask_to_buf(msg + 14, phase_defs[2]);
 	msg[18] = '\n';
 	msg[19] = '\0';
-	write_msg(usb_fd, msg, 19);
+	write_msg(board, msg, 19);
 
-	wait_for_response(usb_fd);
+	wait_for_response(board);
 }
 
-void send_zcs_query_msg (int usb_fd)
+void send_zcs_query_msg (lbio_conn_t *board)
 {
-	write_msg(usb_fd, "ZCS?\n", 5);
-	wait_for_response(usb_fd);
+	write_msg(board, "ZCS?\n", 5);
+	wait_for_response(board);
 }
 
-void send_sw_query_msg (int usb_fd)
+void send_sw_query_msg (lbio_conn_t *board)
 {
-	write_msg(usb_fd, "SW?\n", 4);
-	wait_for_response(usb_fd);
+	write_msg(board, "SW?\n", 4);
+	wait_for_response(board);
 }
 
-void send_phase_query_msg (int usb_fd)
+void send_phase_query_msg (lbio_conn_t *board)
 {
-	write_msg(usb_fd, "PHASE?\n", 7);
-	wait_for_response(usb_fd);
-}
-
-// open a file descriptor to the serial device
-int serialport_open ()
-{
-	// open the file descriptor
-	int fd = open(FTDI_DEVICE_NAME, O_RDWR | O_NOCTTY);
-	if (fd == -1) {
-		printf("unable to open port\n");
-		return -1;
-	}
-
-	// get the current device settings
-	struct termios toptions;
-	if (tcgetattr(fd, &toptions) < 0) {
-		printf("unable to get terminal attribubes\n");
-		return -1;
-	}
-
-	// set the baud rate to 57600
-	speed_t brate = B57600;
-	if (cfsetspeed(&toptions, brate) < 0) {
-		printf("unable to set baudrate\n");
-	}
-
-	// update the serial port options for 8-N-1 (8 data bits, no parity, 1 stop bit)
-	toptions.c_cflag &= ~CSIZE;
-	toptions.c_cflag |= CS8;
-	toptions.c_cflag &= ~PARENB;
-	toptions.c_cflag &= ~CSTOPB;
-
-	// disables special processing of input and output bytes
-	cfmakeraw(&toptions);
-
-	// define what happens on a call to read()
-	toptions.c_cc[VMIN] = 1; 	// block until at least one byte has been read
-	toptions.c_cc[VTIME] = 0;	// never timeout on a read call (could cause hangs but hopefully not)
-
-	// save the changes we made to the options and have them take effect now
-	tcsetattr(fd, TCSANOW, &toptions);
-	if (tcsetattr(fd, TCSAFLUSH, &toptions) < 0) {
-		printf("unable to set terminal attributes\n");
-		return -1;
-	}
-
-	return fd;
+	write_msg(board, "PHASE?\n", 7);
+	wait_for_response(board);
 }
 
 
@@ -230,7 +184,12 @@ int serialport_open ()
 int main (int argc, char **argv)
 {
 	// open connection to ftdi device
-	int usb_fd = serialport_open();
+	lbio_conn_t board_conn;
+	lbio_conn_t *board = &board_conn;
+	if (lbio_open(board, FTDI_DEVICE_NAME) == -1) {
+		printf("unable to open port\n");
+		return 1;
+	}
 	int ret = 0;
 
 	for (int i = 0; i < argc; i++) {
@@ -240,11 +199,11 @@ int main (int argc, char **argv)
 	// handle query messages
 	if (argc == 2) {
 		if (strncmp(argv[1], "ZCS?", 4) == 0) {
-			send_zcs_query_msg(usb_fd);
+			send_zcs_query_msg(board);
 		} else if (strncmp(argv[1], "SW?", 3) == 0) {
-			send_sw_query_msg(usb_fd);
+			send_sw_query_msg(board);
 		} else if (strncmp(argv[1], "PHASE?", 6) == 0) {
-			send_phase_query_msg(usb_fd);
+			send_phase_query_msg(board);
 		} else {
 			printf("Did not enter a valid query message\n");
 			ret = 1;
@@ -254,11 +213,11 @@ int main (int argc, char **argv)
 	// handle command messages
 	if (argc > 2) {
 		if (strncmp(argv[1], "ZCS", 3) == 0) {
-			send_zcs_msg(usb_fd, argv[2]);
+			send_zcs_msg(board, argv[2]);
 		} else if (strncmp(argv[1], "SW", 2) == 0) {
-			send_sw_msg(usb_fd, argv[2]);
+			send_sw_msg(board, argv[2]);
 		} else if (strncmp(argv[1], "PHASE", 5) == 0) {
-			send_phase_msg(usb_fd, &(argv[2]));
+			send_phase_msg(board, &(argv[2]));
 		} else {
 			printf("Did not enter a valid command message\n");
 			ret = 1;
@@ -266,7 +225,7 @@ int main (int argc, char **argv)
 	}
 
 	// Close the file descriptor
-	close(usb_fd);
+	lbio_close(board);
 
 	return ret;
 }
@@ -0,0 +1,442 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <termios.h>
+#include <time.h>
+#include <poll.h>
+#include <netdb.h>
+#include <libgen.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "load_bank_io.h"
+
+// **************************************************** TRANSPORTS *************************************** //
+
+long long lbio_now_us ()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// open the ftdi chip (or anything else that looks like it, eg. load_bank_sim) at 57600 8-N-1, raw
+// the port is not opened exclusively, so that the interactive clis can stay open next to the api; a tool that needs the
+// port to itself takes the device lock and sets TIOCEXCL under it (as load_bank_interface.c does)
+static int serial_open (char *device_name)
+{
+	int fd = open(device_name, O_RDWR | O_NOCTTY);
+	if (fd == -1) {
+		return -1;
+	}
+	struct termios toptions;
+	if (tcgetattr(fd, &toptions) < 0) {
+		close(fd);
+		return -1;
+	}
+	cfsetspeed(&toptions, B57600);
+	cfmakeraw(&toptions);
+	toptions.c_cc[VMIN] = 1;
+	toptions.c_cc[VTIME] = 0;
+	if (tcsetattr(fd, TCSAFLUSH, &toptions) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// connect to the netburner at "host:port", giving up after LBIO_CONNECT_TIMEOUT_MS, with Nagle disabled
+static int tcp_open (char *address)
+{
+	char host[128];
+	strncpy(host, address, sizeof(host) - 1);
+	host[sizeof(host) - 1] = '\0';
+	char *port = strrchr(host, ':');
+	if (port == NULL) {
+		return -1;
+	}
+	*port++ = '\0';
+
+	struct addrinfo hints = { 0 }, *addrs;
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &addrs) != 0) {
+		return -1;
+	}
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	int connected = (fd != -1 && connect(fd, addrs->ai_addr, addrs->ai_addrlen) == 0);
+	freeaddrinfo(addrs);
+	if (fd != -1 && !connected && errno == EINPROGRESS) {
+		struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+		int err = 0;
+		socklen_t err_len = sizeof(err);
+		connected = (poll(&pfd, 1, LBIO_CONNECT_TIMEOUT_MS) == 1 && getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) == 0 && err == 0);
+	}
+	if (!connected) {
+		if (fd != -1) {
+			close(fd);
+		}
+		return -1;
+	}
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+static const lbio_transport_t transports[] = {
+	{ "serial:", serial_open },
+	{ "tcp:", tcp_open },
+};
+
+int lbio_open (lbio_conn_t *conn, char *spec)
+{
+	int fd = -1;
+	int found = 0;
+	for (size_t i = 0; i < sizeof(transports) / sizeof(transports[0]); i++) {
+		int prefix_len = strlen(transports[i].prefix);
+		if (strncmp(spec, transports[i].prefix, prefix_len) == 0) {
+			fd = transports[i].open(spec + prefix_len);
+			found = 1;
+			break;
+		}
+	}
+	if (!found) {
+		fd = serial_open(spec);
+	}
+	lbio_attach(conn, fd);
+	return (fd == -1) ? -1 : 0;
+}
+
+void lbio_attach (lbio_conn_t *conn, int fd)
+{
+	memset(conn, 0, sizeof(*conn));
+	conn->fd = fd;
+	conn->broken = (fd == -1);
+	if (fd != -1) {
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	}
+}
+
+// ************************************************** REQUEST QUEUE ************************************* //
+
+// take the head request off the queue and hand it back to its owner
+static void complete_head (lbio_conn_t *conn, int status)
+{
+	lbio_request_t *req = conn->head;
+	conn->head = req->next;
+	if (conn->head == NULL) {
+		conn->tail = NULL;
+	}
+	conn->tx_len = 0;
+	conn->rx_len = 0;
+	conn->deadline_us = 0;
+	req->next = NULL;
+	req->status = status;
+	if (req->callback != NULL) {
+		req->callback(req, req->arg);
+	}
+}
+
+// give up on the connection: the head request fails with status (or LBIO_NOT_SENT if none of it went out),
+// everything behind it was never sent
+static void fail_all (lbio_conn_t *conn, int status)
+{
+	conn->broken = 1;
+	if (conn->head != NULL) {
+		complete_head(conn, (conn->tx_len > 0) ? status : LBIO_NOT_SENT);
+	}
+	while (conn->head != NULL) {
+		complete_head(conn, LBIO_NOT_SENT);
+	}
+}
+
+// write as much of the head request as the descriptor will take
+static void send_head (lbio_conn_t *conn)
+{
+	lbio_request_t *req = conn->head;
+	while (!conn->broken && req != NULL && conn->tx_len < req->msg_len) {
+		// the timeout runs from the first attempt to write, so a write the descriptor never takes still times out
+		if (conn->deadline_us == 0) {
+			conn->deadline_us = lbio_now_us() + req->timeout_ms * 1000LL;
+		}
+		int n = write(conn->fd, req->msg + conn->tx_len, req->msg_len - conn->tx_len);
+		if (n > 0) {
+			conn->tx_len += n;
+			if (conn->tx_len == req->msg_len) {
+				req->written_us = lbio_now_us();
+			}
+		} else if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0 && errno == EAGAIN) {
+			return;
+		} else {
+			fail_all(conn, LBIO_CLOSED);
+		}
+	}
+}
+
+int lbio_submit (lbio_conn_t *conn, lbio_request_t *req, char *msg, int len, int timeout_ms, lbio_callback_t callback, void *arg)
+{
+	req->status = LBIO_NOT_SENT;
+	req->reply[0] = '\0';
+	req->reply_len = 0;
+	if (conn->broken || len < 0 || len > LBIO_MAX_MSG) {
+		return -1;
+	}
+	req->msg[0] = (char) len;
+	memcpy(req->msg + 1, msg, len);
+	req->msg_len = len + 1;
+	req->timeout_ms = timeout_ms;
+	req->status = LBIO_PENDING;
+	req->written_us = req->first_byte_us = req->replied_us = 0;
+	req->callback = callback;
+	req->arg = arg;
+	req->next = NULL;
+
+	if (conn->tail == NULL) {
+		conn->head = conn->tail = req;
+		send_head(conn);
+	} else {
+		conn->tail->next = req;
+		conn->tail = req;
+	}
+	return 0;
+}
+
+// ************************************************** EVENT HANDLING ************************************* //
+
+int lbio_fd (lbio_conn_t *conn)
+{
+	return conn->fd;
+}
+
+int lbio_events (lbio_conn_t *conn)
+{
+	if (conn->head != NULL && conn->tx_len < conn->head->msg_len) {
+		return POLLIN | POLLOUT;
+	}
+	return POLLIN;
+}
+
+int lbio_timeout (lbio_conn_t *conn)
+{
+	if (conn->head == NULL) {
+		return -1;
+	}
+	long long left_us = conn->deadline_us - lbio_now_us();
+	return (left_us > 0) ? (int) ((left_us + 999) / 1000) : 0;
+}
+
+void lbio_process (lbio_conn_t *conn)
+{
+	send_head(conn);
+	while (!conn->broken) {
+		lbio_request_t *req = conn->head;
+		int n;
+		if (req == NULL || conn->tx_len < req->msg_len) {
+			// nothing has been asked yet, so anything that arrives is stale (eg. the reply to a request that timed out
+			// in an earlier process); throw it away rather than take it for the next reply
+			char discard[64];
+			n = read(conn->fd, discard, sizeof(discard));
+			if (n > 0) {
+				continue;
+			}
+		} else {
+			int want = (conn->rx_len == 0) ? 1 : 1 + (uint8_t) conn->rx[0];
+			n = read(conn->fd, conn->rx + conn->rx_len, want - conn->rx_len);
+			if (n > 0) {
+				if (conn->rx_len == 0) {
+					req->first_byte_us = lbio_now_us();
+				}
+				conn->rx_len += n;
+				if (conn->rx_len == 1 + (uint8_t) conn->rx[0]) {
+					req->reply_len = conn->rx_len - 1;
+					memcpy(req->reply, conn->rx + 1, req->reply_len);
+					req->reply[req->reply_len] = '\0';
+					req->replied_us = lbio_now_us();
+					complete_head(conn, LBIO_OK);
+					send_head(conn);
+				}
+				continue;
+			}
+		}
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0 && errno == EAGAIN) {
+			break;
+		}
+		// end of file, or a real error
+		fail_all(conn, LBIO_CLOSED);
+	}
+
+	// once a reply is overdue the board may still send it, and it would be taken for the reply to the next request
+	// (a head request none of which could be written by its deadline was never sent)
+	if (!conn->broken && conn->head != NULL && lbio_now_us() >= conn->deadline_us) {
+		fail_all(conn, LBIO_TIMEOUT);
+	}
+}
+
+int lbio_wait (lbio_conn_t *conn, lbio_request_t *req)
+{
+	while (req->status == LBIO_PENDING) {
+		struct pollfd pfd = { .fd = conn->fd, .events = lbio_events(conn) };
+		if (poll(&pfd, 1, lbio_timeout(conn)) < 0 && errno != EINTR) {
+			fail_all(conn, LBIO_CLOSED);
+			break;
+		}
+		lbio_process(conn);
+	}
+	return req->status;
+}
+
+int lbio_exchange (lbio_conn_t *conn, char *msg, int len, char *reply, int reply_size, int timeout_ms)
+{
+	lbio_request_t req;
+	lbio_submit(conn, &req, msg, len, timeout_ms, NULL, NULL);
+	int status = lbio_wait(conn, &req);
+	if (reply != NULL && reply_size > 0) {
+		int copy = (req.reply_len < reply_size - 1) ? req.reply_len : reply_size - 1;
+		memcpy(reply, req.reply, copy);
+		reply[copy] = '\0';
+	}
+	return status;
+}
+
+void lbio_close (lbio_conn_t *conn)
+{
+	fail_all(conn, LBIO_CLOSED);
+	if (conn->fd != -1) {
+		close(conn->fd);
+		conn->fd = -1;
+	}
+}
+
+// ************************************************** DEVICE LOCK ************************************* //
+
+int lbio_lock_acquire (char *device_name, int timeout_ms, char *command, char *holder, int holder_size)
+{
+	// lock file is named after the device, eg. /tmp/load_bank.ttyUSB0.lock
+	char path[256];
+	char name_copy[128];
+	strncpy(name_copy, device_name, sizeof(name_copy) - 1);
+	name_copy[sizeof(name_copy) - 1] = '\0';
+	snprintf(path, sizeof(path), "%s/load_bank.%s.lock", LBIO_LOCK_DIR, basename(name_copy));
+
+	// the directory is world writable, so never follow a symlink planted in place of the lock file, and only
+	// open up the permissions of a file this process created itself (so that tools run by other users can share it)
+	int lock_fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0666);
+	if (lock_fd != -1) {
+		fchmod(lock_fd, 0666);
+	} else if (errno == EEXIST) {
+		lock_fd = open(path, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+	}
+	struct stat st;
+	if (lock_fd != -1 && (fstat(lock_fd, &st) != 0 || !S_ISREG(st.st_mode))) {
+		close(lock_fd);
+		lock_fd = -1;
+	}
+	if (lock_fd == -1) {
+		return LBIO_LOCK_ERROR;
+	}
+
+	// poll for the lock, backing off from 1 ms up to 20 ms between attempts
+	long long deadline_us = lbio_now_us() + timeout_ms * 1000LL;
+	int backoff_us = 1000;
+	while (flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+		if ((errno != EWOULDBLOCK && errno != EINTR) || lbio_now_us() >= deadline_us) {
+			// report who has the device, but only a complete record (the holder may be part way through writing it)
+			if (holder != NULL && holder_size > 0) {
+				int len = pread(lock_fd, holder, holder_size - 1, 0);
+				len = (len > 0) ? len : 0;
+				while (len > 0 && holder[len - 1] == '\n') {
+					len--;
+				}
+				holder[len] = '\0';
+				if (len < 2 || holder[0] != '{' || holder[len - 1] != '}') {
+					holder[0] = '\0';
+				}
+			}
+			close(lock_fd);
+			return LBIO_LOCK_BUSY;
+		}
+		usleep(backoff_us);
+		backoff_us = (backoff_us * 2 > 20000) ? 20000 : backoff_us * 2;
+	}
+
+	// record ourselves as the holder (the command may come from a client, so it is escaped, and cut short to fit)
+	char record[256];
+	char escaped[160];
+	struct timespec now;
+	lbio_json_escape(escaped, sizeof(escaped), command);
+	clock_gettime(CLOCK_REALTIME, &now);
+	int len = snprintf(record, sizeof(record), "{\"pid\": %d, \"command\": \"%s\", \"since\": %lld}\n",
+		getpid(), escaped, (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000);
+	ftruncate(lock_fd, 0);
+	pwrite(lock_fd, record, len, 0);
+	return lock_fd;
+}
+
+void lbio_lock_release (int lock_fd)
+{
+	ftruncate(lock_fd, 0);
+	close(lock_fd);		// closing the file releases the flock
+}
+
+// ****************************************************** JSON ******************************************* //
+
+void lbio_json_escape (char *dst, int size, const char *src)
+{
+	int len = 0;
+	for (; *src != '\0'; src++) {
+		int need = (*src == '"' || *src == '\\') ? 2 : 1;
+		if (len + need > size - 1) {
+			break;
+		}
+		if (need == 2) {
+			dst[len++] = '\\';
+			dst[len++] = *src;
+		} else {
+			dst[len++] = ((unsigned char) *src < 0x20 || *src == 0x7f) ? '?' : *src;
+		}
+	}
+	dst[len] = '\0';
+}
+
+// **************************************************** RATINGS ****************************************** //
+
+void lbio_load_ratings (float *ratings, int num_switches)
+{
+	for (int i = 0; i < num_switches; i++) {
+		ratings[i] = LBIO_DEFAULT_RATING_KW;
+	}
+
+	char *pos = getenv(LBIO_RATINGS_ENV_NAME);
+	if (pos == NULL) {
+		return;
+	}
+	for (int i = 0; i < num_switches && *pos != '\0'; i++) {
+		char *end;
+		float rating = strtof(pos, &end);
+		if (end == pos) {
+			break;
+		}
+		ratings[i] = rating;
+		while (*end == ' ') {
+			end++;
+		}
+		if (*end == ',') {
+			end++;
+		} else if (*end != '\0') {
+			break;
+		}
+		pos = end;
+	}
+}
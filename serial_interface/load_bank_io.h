@@ -0,0 +1,125 @@
+#ifndef LOAD_BANK_IO_H
+#define LOAD_BANK_IO_H
+
+#include <stdint.h>
+
+// Shared non-blocking I/O with a load bank board, used by all of the tools in this directory (compile load_bank_io.c
+// in with each of them, eg. gcc -o serial_interface load_bank_interface.c load_bank_io.c).
+// A connection wraps the file descriptor of one path to the board (the ftdi serial link or the netburner) and queues
+// requests on it; the board answers one message at a time, so requests go out in order, the next one as soon as the
+// previous one is answered. Nothing here blocks except lbio_wait and lbio_exchange:
+//	lbio_conn_t board;
+//	lbio_request_t req;
+//	lbio_open(&board, "tcp:192.168.68.117:23");
+//	lbio_submit(&board, &req, "SW?\n", 4, 2000, on_reply, NULL);
+//	...then poll or epoll lbio_fd(&board) for lbio_events(&board), waiting at most lbio_timeout(&board) ms,
+//	and call lbio_process(&board) whenever it returns; on_reply is called from there when the request completes.
+// lbio_process reads until EAGAIN, so the descriptor can be registered edge-triggered with epoll. Connections and
+// requests are allocated by the caller and nothing is allocated here. Requests must stay valid until they complete,
+// and a callback may submit further requests but must not close the connection.
+
+#define LBIO_MAX_MSG 255		// longest message that can be sent (PHASE is the longest, 19 bytes on an 18 switch bank)
+#define LBIO_MAX_REPLY 255		// the board prefixes replies with a one byte length
+#define LBIO_CONNECT_TIMEOUT_MS 1000	// give up connecting to the netburner after this long
+#define LBIO_LOCK_DIR "/tmp"		// directory holding the lock file of each device (load_bank.<device>.lock)
+#define LBIO_RATINGS_ENV_NAME "LOAD_BANK_RATINGS_KW"	// comma-separated per-switch ratings in kW, first switch first
+#define LBIO_DEFAULT_RATING_KW 1.0	// rating of every switch not given a rating by LOAD_BANK_RATINGS_KW
+
+// status of a request
+#define LBIO_PENDING 0		// queued, or sent and waiting for the reply
+#define LBIO_OK 1		// the board replied; the reply is in reply
+#define LBIO_TIMEOUT 2		// sent, but not answered within the timeout
+#define LBIO_NOT_SENT 3		// the connection failed before any of the request was written
+#define LBIO_CLOSED 4		// sent, but the connection failed before the reply arrived
+
+typedef struct lbio_request lbio_request_t;
+typedef void (*lbio_callback_t) (lbio_request_t *req, void *arg);
+
+struct lbio_request {
+	char msg[LBIO_MAX_MSG + 1];	// length byte followed by the message
+	int msg_len;			// including the length byte
+	int timeout_ms;			// from the start of the write to the end of the reply
+	int status;
+	char reply[LBIO_MAX_REPLY + 1];	// reply without its length byte, nul terminated
+	int reply_len;
+	long long written_us;		// CLOCK_MONOTONIC times of the end of the write, the first reply byte and the last one
+	long long first_byte_us;
+	long long replied_us;
+	lbio_callback_t callback;	// called once the request completes (may be NULL)
+	void *arg;
+	lbio_request_t *next;
+};
+
+typedef struct {
+	int fd;
+	int broken;			// set after a timeout or error, since later replies could no longer be matched to requests
+	lbio_request_t *head;		// request being sent or answered; the rest wait behind it
+	lbio_request_t *tail;
+	int tx_len;			// bytes of the head request written so far
+	long long deadline_us;		// CLOCK_MONOTONIC time the head request times out (0 until its write is first tried)
+	char rx[LBIO_MAX_REPLY + 1];	// reply received so far, length byte first
+	int rx_len;
+} lbio_conn_t;
+
+// a way of reaching the board: spec prefix and a function opening the rest of the spec, returning an fd or -1
+typedef struct {
+	char *prefix;
+	int (*open) (char *address);
+} lbio_transport_t;
+
+// CLOCK_MONOTONIC time in microseconds (the clock of the request timestamps)
+long long lbio_now_us ();
+
+// open a connection from a spec: "serial:<device>", "tcp:<host>:<port>", or just a device path (serial)
+// return 0 on success, -1 if the path could not be opened
+int lbio_open (lbio_conn_t *conn, char *spec);
+
+// wrap a descriptor the caller has already opened and configured (it is made non-blocking)
+void lbio_attach (lbio_conn_t *conn, int fd);
+
+// fail whatever is still queued (calling the callbacks) and close the descriptor
+void lbio_close (lbio_conn_t *conn);
+
+// queue msg (without its length byte) on the connection; it is written straight away if nothing is ahead of it
+// return 0 if queued, -1 if the message is too long or the connection is broken (status is then LBIO_NOT_SENT)
+int lbio_submit (lbio_conn_t *conn, lbio_request_t *req, char *msg, int len, int timeout_ms, lbio_callback_t callback, void *arg);
+
+// descriptor to poll, the poll events it needs (POLLIN, plus POLLOUT while a write is incomplete),
+// and how long to wait before calling lbio_process anyway (-1 if no request is queued)
+int lbio_fd (lbio_conn_t *conn);
+int lbio_events (lbio_conn_t *conn);
+int lbio_timeout (lbio_conn_t *conn);
+
+// make whatever progress is possible without blocking: write, read, complete requests and expire timeouts
+void lbio_process (lbio_conn_t *conn);
+
+// block until req completes and return its status
+int lbio_wait (lbio_conn_t *conn, lbio_request_t *req);
+
+// blocking round trip: send msg and copy the reply (nul terminated, truncated to reply_size) into reply
+// return the status of the request
+int lbio_exchange (lbio_conn_t *conn, char *msg, int len, char *reply, int reply_size, int timeout_ms);
+
+// take exclusive ownership of a device, waiting at most timeout_ms for whoever holds it now
+// the lock is an flock on a per-device lock file shared by every tool here, so the kernel releases it when its holder
+// exits for any reason (including being killed); the holder's pid, command and start time are written into the file
+// returns the lock file descriptor (release it with lbio_lock_release, not inherited by child processes), LBIO_LOCK_ERROR
+// if the lock file could not be opened (or is a symlink or anything but a regular file), or LBIO_LOCK_BUSY if the device stayed busy; holder (if not NULL) is then given the current holder's record,
+// or "" if there is no complete one
+#define LBIO_LOCK_ERROR -1
+#define LBIO_LOCK_BUSY -2
+int lbio_lock_acquire (char *device_name, int timeout_ms, char *command, char *holder, int holder_size);
+
+// give up ownership of the device
+void lbio_lock_release (int lock_fd);
+
+// copy src into dst (size bytes, including the nul) as the inside of a JSON string: quotes and backslashes are escaped
+// and control characters replaced with '?'; a src too long for dst is cut short, never in the middle of an escape
+void lbio_json_escape (char *dst, int size, const char *src);
+
+// fill ratings with the kW rating of each of num_switches switches, from LOAD_BANK_RATINGS_KW, the one list shared by
+// every tool that needs them; the list is read up to its end or its first entry that is not a number (which ends it),
+// and the switches past that keep the default rating
+void lbio_load_ratings (float *ratings, int num_switches);
+
+#endif
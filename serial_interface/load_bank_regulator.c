@@ -0,0 +1,301 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <math.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "load_bank_io.h"
+#include "load_bank_geometry.h"
+
+// Closed-loop load regulation (build with load_bank_io.c and -lm)
+// Holds a measured power at a setpoint by switching the load bank. Power samples (in kW, one ASCII number per line
+// or datagram) are read from a FIFO or a Unix datagram socket that a meter reader, or a test, writes to:
+//	mkfifo /tmp/meter && ./load_bank_regulator -s 12.5 -i fifo:/tmp/meter
+//	./load_bank_regulator -s 12.5 -i unix:/tmp/meter.sock -r 5 -b 0.5
+// At a fixed rate the latest sample is compared with the setpoint; outside the hysteresis band the commanded load is
+// integrated towards the setpoint and turned into a switch mask that changes as few relays as possible. A SW command
+// is only sent when the mask actually changes. The loop does no allocation, so its timing and output depend only on the
+// samples it is given.
+
+#define BUFSIZE ((GEOMETRY_BUFSIZE > 32) ? GEOMETRY_BUFSIZE : 32)
+
+#define FTDI_DEVICE_NAME "/dev/ttyUSB0"
+#define DEVICE_ENV_NAME "LOAD_BANK_DEVICE"
+#define LOCK_TIMEOUT_MS 2000		// a tick that cannot get the device within this long skips its actuation
+#define RESPONSE_TIMEOUT_MS 12000	// longer than the 10 s zero-crossing timeout of the board
+
+#define DEFAULT_RATE_HZ 2.0
+#define DEFAULT_HYSTERESIS_KW 0.5
+#define DEFAULT_GAIN 0.5		// fraction of the tracking error added to the commanded load each tick
+
+// **************************************************** SYSTEM UTILITIES *************************************** //
+
+// current time in microseconds on the monotonic clock
+long long now_us ()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// send one length-prefixed command and read its reply, holding the device lock only for the exchange
+// return 0 if the board replied, -1 otherwise
+int device_exchange (char *device_name, char *msg, int len, char *ret)
+{
+	int lock_fd = lbio_lock_acquire(device_name, LOCK_TIMEOUT_MS, "REGULATOR", NULL, 0);
+	if (lock_fd < 0) {
+		return -1;
+	}
+	int result = -1;
+	lbio_conn_t board;
+	if (lbio_open(&board, device_name) == 0) {
+		result = (lbio_exchange(&board, msg, len, ret, BUFSIZE, RESPONSE_TIMEOUT_MS) == LBIO_OK) ? 0 : -1;
+		lbio_close(&board);
+	}
+	lbio_lock_release(lock_fd);
+	return result;
+}
+
+// ********************************************************* REGULATOR ******************************************** //
+
+float ratings[NUM_SWITCHES];
+int by_rating[NUM_SWITCHES];		// switch indices in order of decreasing rating (ties by switch number)
+float total_rating = 0;
+
+// load the switch ratings (the LOAD_BANK_RATINGS_KW list, read the same way as for the staged planner of
+// load_bank_interface) and sort the switches by rating
+void load_switch_ratings ()
+{
+	lbio_load_ratings(ratings, NUM_SWITCHES);
+	for (int i = 0; i < NUM_SWITCHES; i++) {
+		total_rating += ratings[i];
+	}
+	for (int i = 0; i < NUM_SWITCHES; i++) {
+		int j = i;
+		while (j > 0 && ratings[by_rating[j - 1]] < ratings[i]) {
+			by_rating[j] = by_rating[j - 1];
+			j--;
+		}
+		by_rating[j] = i;
+	}
+}
+
+// rated load of the switches in mask
+float mask_rating (mask_t mask)
+{
+	float kw = 0;
+	for (int i = 0; i < NUM_SWITCHES; i++) {
+		if (mask & MASK_BIT(i)) {
+			kw += ratings[i];
+		}
+	}
+	return kw;
+}
+
+// move from the current mask towards target_kw changing as few relays as possible: turn on the largest switches that
+// still fit under the target (or turn off the largest that can go without undershooting it), largest first
+mask_t choose_mask (mask_t current, float target_kw)
+{
+	mask_t mask = current;
+	float kw = mask_rating(mask);
+	for (int k = 0; k < NUM_SWITCHES; k++) {
+		int i = by_rating[k];
+		if (kw < target_kw && !(mask & MASK_BIT(i)) && kw + ratings[i] <= target_kw + ratings[i] / 2) {
+			mask |= MASK_BIT(i);
+			kw += ratings[i];
+		} else if (kw > target_kw && (mask & MASK_BIT(i)) && kw - ratings[i] >= target_kw - ratings[i] / 2) {
+			mask &= ~MASK_BIT(i);
+			kw -= ratings[i];
+		}
+	}
+	return mask;
+}
+
+// open the sample source ("fifo:<path>" or "unix:<path>") for non-blocking reads; returns the fd or -1
+int open_source (char *spec)
+{
+	if (strncmp(spec, "fifo:", 5) == 0) {
+		// O_RDWR keeps the fifo open (and reads non-blocking) while no writer is connected
+		return open(spec + 5, O_RDWR | O_NONBLOCK);
+	} else if (strncmp(spec, "unix:", 5) == 0) {
+		int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+		struct sockaddr_un addr = { .sun_family = AF_UNIX };
+		strncpy(addr.sun_path, spec + 5, sizeof(addr.sun_path) - 1);
+		unlink(addr.sun_path);
+		if (fd == -1 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+			return -1;
+		}
+		return fd;
+	}
+	return -1;
+}
+
+// read everything waiting on the source and keep the last complete sample; returns the number of samples read
+int drain_samples (int fd, float *latest)
+{
+	static char pending[256];		// partial line carried over between reads (fifo only)
+	static int pending_len = 0;
+	char buf[1024];
+	int count = 0;
+	int n;
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		for (int i = 0; i < n; i++) {
+			if (buf[i] == '\n' || pending_len == sizeof(pending) - 1) {
+				pending[pending_len] = '\0';
+				char *end;
+				float value = strtof(pending, &end);
+				if (end != pending) {
+					*latest = value;
+					count++;
+				}
+				pending_len = 0;
+			} else {
+				pending[pending_len++] = buf[i];
+			}
+		}
+		// a datagram is a whole sample even without a trailing newline
+		if (pending_len > 0 && buf[n - 1] != '\n' && n < (int) sizeof(buf)) {
+			struct stat st;
+			if (fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode)) {
+				pending[pending_len] = '\0';
+				*latest = strtof(pending, NULL);
+				count++;
+				pending_len = 0;
+			}
+		}
+	}
+	return count;
+}
+
+volatile sig_atomic_t running = 1;
+
+void stop (int sig)
+{
+	(void) sig;
+	running = 0;
+}
+
+// ************************************************************ MAIN FUNCTION ***************************************** //
+
+int main (int argc, char **argv)
+{
+	float setpoint_kw = NAN, hysteresis_kw = DEFAULT_HYSTERESIS_KW, gain = DEFAULT_GAIN;
+	double rate_hz = DEFAULT_RATE_HZ;
+	char *source = NULL;
+	char *device_name = getenv(DEVICE_ENV_NAME) ? getenv(DEVICE_ENV_NAME) : FTDI_DEVICE_NAME;
+	int log_every = 1;
+	int opt;
+	while ((opt = getopt(argc, argv, "s:i:r:b:g:d:l:")) != -1) {
+		switch (opt) {
+			case 's': setpoint_kw = atof(optarg); break;
+			case 'i': source = optarg; break;
+			case 'r': rate_hz = atof(optarg); break;
+			case 'b': hysteresis_kw = atof(optarg); break;
+			case 'g': gain = atof(optarg); break;
+			case 'd': device_name = optarg; break;
+			case 'l': log_every = atoi(optarg); break;
+			default: source = NULL; setpoint_kw = NAN; break;
+		}
+	}
+	if (isnan(setpoint_kw) || source == NULL || rate_hz <= 0 || log_every < 1) {
+		fprintf(stderr, "usage: %s -s setpoint_kw -i fifo:<path>|unix:<path> [-r rate_hz] [-b hysteresis_kw] [-g gain] [-d device] [-l log every n ticks]\n", argv[0]);
+		return 1;
+	}
+
+	int source_fd = open_source(source);
+	if (source_fd == -1) {
+		fprintf(stderr, "could not open sample source %s\n", source);
+		return 1;
+	}
+	load_switch_ratings();
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+
+	// start from whatever the switches are now
+	char ret[BUFSIZE];
+	mask_t mask = 0;
+	if (device_exchange(device_name, "SW?\n", 4, ret) == 0 && strncmp(ret, "SW ", 3) == 0) {
+		mask = buf_to_mask(ret + 3) & ALL_SWITCHES;
+	}
+	float commanded_kw = mask_rating(mask);
+
+	// loop statistics
+	long ticks = 0, tracked_ticks = 0, samples = 0, actuations = 0, failed_actuations = 0, overruns = 0;
+	double abs_error_sum = 0, sq_error_sum = 0;
+	float measured_kw = NAN;
+
+	long long period_ns = (long long)(1e9 / rate_hz);
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (running) {
+		// wait for the next tick (absolute, so the rate does not drift); ticks that are already past are skipped
+		long long next_ns = (long long) next.tv_sec * 1000000000LL + next.tv_nsec + period_ns;
+		long long now_ns = now_us() * 1000;
+		if (next_ns < now_ns) {
+			overruns += (now_ns - next_ns) / period_ns + 1;
+			next_ns += ((now_ns - next_ns) / period_ns + 1) * period_ns;
+		}
+		next.tv_sec = next_ns / 1000000000LL;
+		next.tv_nsec = next_ns % 1000000000LL;
+		if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR && !running) {
+			break;
+		}
+		ticks++;
+
+		int new_samples = drain_samples(source_fd, &measured_kw);
+		samples += new_samples;
+		if (isnan(measured_kw)) {
+			continue;
+		}
+
+		// integrate the error into the commanded load, but only outside the hysteresis band (to avoid relay chatter)
+		float error_kw = setpoint_kw - measured_kw;
+		tracked_ticks++;
+		abs_error_sum += fabs(error_kw);
+		sq_error_sum += error_kw * error_kw;
+		if (new_samples > 0 && fabs(error_kw) > hysteresis_kw) {
+			commanded_kw += gain * error_kw;
+			commanded_kw = (commanded_kw < 0) ? 0 : (commanded_kw > total_rating) ? total_rating : commanded_kw;
+		}
+
+		// only talk to the board when the switches actually have to change
+		mask_t new_mask = choose_mask(mask, commanded_kw);
+		if (new_mask != mask) {
+			char msg[BUFSIZE];
+			memcpy(msg, "SW ", 3);
+			mask_to_buf(msg + 3, new_mask);
+			msg[SW_MSG_LEN - 1] = '\n';
+			if (device_exchange(device_name, msg, SW_MSG_LEN, ret) == 0 && strncmp(ret, "OK", 2) == 0) {
+				mask = new_mask;
+				actuations++;
+			} else {
+				failed_actuations++;
+			}
+		}
+
+		if (ticks % log_every == 0) {
+			char binstring[NUM_SWITCHES + 1];
+			mask_to_chars(mask, binstring);
+			binstring[NUM_SWITCHES] = '\0';
+			printf("{\"tick\": %ld, \"measured_kw\": %.3f, \"setpoint_kw\": %.3f, \"error_kw\": %.3f, \"commanded_kw\": %.3f, \"switches\": \"%s\", \"actuations\": %ld}\n",
+				ticks, measured_kw, setpoint_kw, error_kw, commanded_kw, binstring, actuations);
+			fflush(stdout);
+		}
+	}
+
+	// summary of how well the setpoint was tracked
+	long tracked = (tracked_ticks > 0) ? tracked_ticks : 1;
+	printf("{\"ticks\": %ld, \"samples\": %ld, \"actuations\": %ld, \"failed_actuations\": %ld, \"overruns\": %ld, \"mean_abs_error_kw\": %.3f, \"rms_error_kw\": %.3f}\n",
+		ticks, samples, actuations, failed_actuations, overruns, abs_error_sum / tracked, sqrt(sq_error_sum / tracked));
+	close(source_fd);
+	return 0;
+}
@@ -0,0 +1,230 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <termios.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "load_bank_geometry.h"
+
+// Simulated load bank board for testing without hardware.
+// Creates a pseudo-terminal that speaks the same length-prefixed protocol as the c2000 behind the ftdi chip,
+// and links it to a path that the serial interface can be pointed at with LOAD_BANK_DEVICE, eg:
+//	./load_bank_sim -d /tmp/ttyLOADBANK &
+//	LOAD_BANK_DEVICE=/tmp/ttyLOADBANK ./serial_interface SW?
+// With -t it also listens on a TCP port like the netburner does, sharing the same simulated board:
+//	./load_bank_sim -d /tmp/ttyLOADBANK -t 2323 &
+//	LOAD_BANK_DEVICE=/tmp/ttyLOADBANK LOAD_BANK_TRANSPORT=tcp:127.0.0.1:2323 ./serial_interface SW?
+
+#define BUFSIZE ((GEOMETRY_BUFSIZE > 32) ? GEOMETRY_BUFSIZE : 32)
+
+#define DEFAULT_LINK_NAME "/tmp/ttyLOADBANK"	// path the simulated device is linked to
+#define DEFAULT_MAINS_HZ 60.0			// frequency of the simulated mains (zero crossings happen at twice this rate)
+
+// **************************************************** SIMULATED BOARD ******************************************* //
+
+mask_t sw_state = 0;				// switches that are on
+mask_t phase_defs[NUM_PHASES];			// switches assigned to each phase (split evenly in main, eg. 1-6, 7-12, 13-18)
+int zcs_on = 1;					// whether switch changes wait for a zero crossing
+double mains_hz = DEFAULT_MAINS_HZ;
+int latency_ms = 0;				// extra delay before each reply (eg. to mimic the ftdi latency timer)
+
+// sleep until the next simulated zero crossing
+void wait_for_zero_crossing ()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long half_period_ns = (long)(1e9 / (2 * mains_hz));
+	long now_ns = (now.tv_sec % 1000) * 1000000000L + now.tv_nsec;
+	long wait_ns = half_period_ns - (now_ns % half_period_ns);
+	struct timespec wait = { wait_ns / 1000000000L, wait_ns % 1000000000L };
+	nanosleep(&wait, NULL);
+}
+
+// read exactly len bytes from fd, retrying while the other side of the pty is closed between commands
+// return 0 on success, -1 if fd is a socket that was closed
+int read_exact (int fd, char *buf, int len)
+{
+	int got = 0;
+	while (got < len) {
+		int n = read(fd, buf + got, len - got);
+		if (n > 0) {
+			got += n;
+		} else if (n == 0 || (errno != EIO && errno != EINTR && errno != EAGAIN)) {
+			return -1;
+		} else {
+			usleep(1000);
+		}
+	}
+	return 0;
+}
+
+// send a length-prefixed reply
+void reply (int fd, char *msg, uint8_t len)
+{
+	if (latency_ms > 0) {
+		usleep(latency_ms * 1000);
+	}
+	char buf[BUFSIZE + 1];
+	buf[0] = (char) len;
+	memcpy(buf + 1, msg, len);
+	write(fd, buf, len + 1);
+}
+
+// act on one message from the serial interface and reply the way the c2000 would
+void handle_msg (int fd, char *msg, int len)
+{
+	char ret[BUFSIZE];
+	if (len >= 4 && strncmp(msg, "SW?\n", 4) == 0) {
+		sprintf(ret, "SW ");
+		mask_to_buf(ret + 3, sw_state);
+		ret[SW_MSG_LEN - 1] = '\n';
+		reply(fd, ret, SW_MSG_LEN);
+	} else if (len >= SW_MSG_LEN && strncmp(msg, "SW ", 3) == 0) {
+		if (zcs_on) {
+			wait_for_zero_crossing();
+		}
+		sw_state = buf_to_mask(msg + 3) & ALL_SWITCHES;
+		reply(fd, "OK\n", 3);
+	} else if (len >= 7 && strncmp(msg, "PHASE?\n", 7) == 0) {
+		sprintf(ret, "PHASE ");
+		for (int p = 0; p < NUM_PHASES; p++) {
+			mask_to_buf(ret + 6 + (p * MASK_BYTES), phase_defs[p]);
+		}
+		ret[PHASE_MSG_LEN - 1] = '\n';
+		reply(fd, ret, PHASE_MSG_LEN);
+	} else if (len >= PHASE_MSG_LEN && strncmp(msg, "PHASE ", 6) == 0) {
+		for (int p = 0; p < NUM_PHASES; p++) {
+			phase_defs[p] = buf_to_mask(msg + 6 + (p * MASK_BYTES));
+		}
+		reply(fd, "OK\n", 3);
+	} else if (len >= 5 && strncmp(msg, "ZCS?\n", 5) == 0) {
+		if (zcs_on) {
+			reply(fd, "ZCS ON\n", 7);
+		} else {
+			reply(fd, "ZCS OFF\n", 8);
+		}
+	} else if (len >= 7 && strncmp(msg, "ZCS ON\n", 7) == 0) {
+		zcs_on = 1;
+		reply(fd, "OK\n", 3);
+	} else if (len >= 8 && strncmp(msg, "ZCS OFF\n", 8) == 0) {
+		zcs_on = 0;
+		reply(fd, "OK\n", 3);
+	} else {
+		reply(fd, "ERR BAD REQUEST\n", 16);
+	}
+}
+
+// ************************************************************ MAIN FUNCTION ***************************************** //
+
+int main (int argc, char **argv)
+{
+	char *link_name = DEFAULT_LINK_NAME;
+	int tcp_port = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "d:f:l:t:")) != -1) {
+		switch (opt) {
+			case 'd': link_name = optarg; break;
+			case 't': tcp_port = atoi(optarg); break;
+			case 'f': mains_hz = atof(optarg); break;
+			case 'l': latency_ms = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-d link path] [-f mains hz] [-l reply latency ms] [-t tcp port]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	// start with the switches split evenly across the phases
+	for (int i = 0; i < NUM_SWITCHES; i++) {
+		phase_defs[(i * NUM_PHASES) / NUM_SWITCHES] |= MASK_BIT(i);
+	}
+
+	// create the pseudo-terminal
+	int master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master_fd == -1 || grantpt(master_fd) != 0 || unlockpt(master_fd) != 0) {
+		perror("posix_openpt");
+		return 1;
+	}
+	char *slave_name = ptsname(master_fd);
+
+	// keep the slave side open in raw mode ourselves so that nothing is echoed back before the serial interface
+	// configures it, and so the master does not see a hangup every time a serial interface process exits
+	int slave_fd = open(slave_name, O_RDWR | O_NOCTTY);
+	struct termios toptions;
+	tcgetattr(slave_fd, &toptions);
+	cfmakeraw(&toptions);
+	tcsetattr(slave_fd, TCSANOW, &toptions);
+
+	// link the slave to a fixed path
+	unlink(link_name);
+	if (symlink(slave_name, link_name) != 0) {
+		perror("symlink");
+		return 1;
+	}
+	// optionally listen for netburner-style tcp connections as well
+	int listen_fd = -1;
+	if (tcp_port > 0) {
+		listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+		int one = 1;
+		setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(tcp_port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+		if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(listen_fd, 4) != 0) {
+			perror("tcp listen");
+			return 1;
+		}
+	}
+	printf("simulated load bank on %s (%s), mains %.1f Hz", link_name, slave_name, mains_hz);
+	if (tcp_port > 0) {
+		printf(", tcp port %d", tcp_port);
+	}
+	printf("\n");
+	fflush(stdout);
+
+	// serve messages forever: a length byte followed by that many bytes of payload, from the pty or the tcp client
+	char msg[256];
+	int client_fd = -1;
+	while (1) {
+		struct pollfd fds[3] = {
+			{ .fd = master_fd, .events = POLLIN },
+			{ .fd = listen_fd, .events = POLLIN },
+			{ .fd = client_fd, .events = POLLIN },
+		};
+		if (poll(fds, 3, -1) < 0) {
+			continue;
+		}
+		if (fds[1].revents & POLLIN) {
+			// one netburner client at a time, like the real one
+			if (client_fd != -1) {
+				close(client_fd);
+			}
+			client_fd = accept(listen_fd, NULL, NULL);
+			int one = 1;
+			setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		}
+		for (int i = 0; i < 3; i += 2) {
+			if (!(fds[i].revents & (POLLIN | POLLHUP)) || fds[i].fd == -1) {
+				continue;
+			}
+			uint8_t len;
+			if (read_exact(fds[i].fd, (char *) &len, 1) != 0 || read_exact(fds[i].fd, msg, len) != 0) {
+				if (fds[i].fd == client_fd) {
+					close(client_fd);
+					client_fd = -1;
+				}
+				continue;
+			}
+			handle_msg(fds[i].fd, msg, len);
+		}
+	}
+
+	close(slave_fd);
+	return 0;
+}
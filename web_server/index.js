@@ -49,10 +49,8 @@ for (let i = 0; i < totalSwitches; i++) {
 var zcsSetSwitch = document.getElementById("zcs")
 var zcsDispSwitch = document.getElementById("zcs-display")
 
-// Query everything and display on page when first loaded in
-getSwitchStatus();
-getZCSStatus();
-getPhaseStatus();
+// Query everything (in one call) and display on page when first loaded in
+getState();
 
 // Display the current status of the switches according the the 'states' string (eg. "111111000000111111")
 function displaySwitchStatus(states) {
@@ -207,6 +205,36 @@ async function setPhaseStatus() {
     getPhaseStatus()
 }
 
+// Getting the switch, phase and ZCS status from the Load Bank all at once
+async function getState() {
+    const url = apiURLheader + "state"
+
+    let result = await getApiResult(url);
+    console.log(result);
+
+    // if the query failed (eg. a serial interface built before STATE? existed), fall back to querying each one on its own
+    if (result === null || result.status != "OK") {
+        await getSwitchStatus();
+        await getZCSStatus();
+        await getPhaseStatus();
+        return
+    }
+
+    displaySwitchStatus(result.switches)
+    switchMessageDisp.textContent = JSON.stringify({ status: result.status, switches: result.switches })
+    switchMessageDisp.style.color = "black";
+
+    displayPhaseStatus(result.phases);
+    phaseMessageDisp.textContent = JSON.stringify({ status: result.status, phases: result.phases })
+
+    zcsMessageDisp.textContent = JSON.stringify({ status: result.status, zcs: result.zcs })
+    if (result.zcs == "1") {
+        zcsDispSwitch.checked = true;
+    } else if (result.zcs == "0") {
+        zcsDispSwitch.checked = false;
+    }
+}
+
 // Making a HTTP Get API call and expecting a Json result
 async function getApiResult(url) {
     var requestOptions = {